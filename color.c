@@ -0,0 +1,160 @@
+#include <math.h>
+#include <pthread.h>
+#include <omp.h>
+#include "kmeans.h"
+
+/*
+    Perceptual color spaces. Points are converted in place into 8-bit fixed
+    point (L, a, b) stored in the (R, G, B) bytes, so both engines cluster
+    them with their usual integer distances and need no changes. All axes
+    share one scale, which keeps distances proportional to the color
+    difference of the space; a and b are centered on the middle of their
+    sRGB gamut range. Centroids are converted back to sRGB at the end.
+*/
+
+struct ColorSpaceScale {
+    float scale;                // stored units per unit of the space
+    float midA;                 // middle of the a range of the sRGB gamut, stored as 128
+    float midB;
+};
+
+static const struct ColorSpaceScale scales[] = {
+    [COLOR_OKLAB] = { 250.0f, 0.0212f, -0.0565f },    // L 0..1, a -0.234..0.276, b -0.312..0.199
+    [COLOR_LAB] = { 1.25f, 6.0f, -6.7f },              // L 0..100, a -86.2..98.2, b -107.9..94.5
+};
+
+// sRGB byte to linear light
+static float linearTable[256];
+static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+
+static void buildLinearTable(void) {
+    for (int i = 0; i < 256; i++) {
+        float c = i / 255.0f;
+        linearTable[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+}
+
+static unsigned char encodeSRGB(float c) {
+    c = c <= 0.0031308f ? 12.92f * c : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+    c = c * 255 + 0.5f;
+    return c < 0 ? 0 : c > 255 ? 255 : (unsigned char) c;
+}
+
+static unsigned char quantize(float v) {
+    v += 0.5f;
+    return v < 0 ? 0 : v > 255 ? 255 : (unsigned char) v;
+}
+
+
+/*   CIELAB (D65 white)    */
+
+static inline float labF(float t) {
+    return t > 0.008856452f ? cbrtf(t) : t * 7.787037f + 0.137931f;
+}
+
+static inline float labInverseF(float t) {
+    return t > 0.206897f ? t * t * t : (t - 0.137931f) * 0.128419f;
+}
+
+static inline void rgbToLab(float r, float g, float b, float *lab) {
+    float x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f;
+    float y = 0.2126729f * r + 0.7151522f * g + 0.0721750f * b;
+    float z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f;
+    float fx = labF(x), fy = labF(y), fz = labF(z);
+    lab[0] = 116 * fy - 16;
+    lab[1] = 500 * (fx - fy);
+    lab[2] = 200 * (fy - fz);
+}
+
+static inline void labToRgb(const float *lab, float *rgb) {
+    float fy = (lab[0] + 16) / 116;
+    float x = 0.95047f * labInverseF(fy + lab[1] / 500);
+    float y = labInverseF(fy);
+    float z = 1.08883f * labInverseF(fy - lab[2] / 200);
+    rgb[0] = 3.2404542f * x - 1.5371385f * y - 0.4985314f * z;
+    rgb[1] = -0.9692660f * x + 1.8760108f * y + 0.0415560f * z;
+    rgb[2] = 0.0556434f * x - 0.2040259f * y + 1.0572252f * z;
+}
+
+
+/*   OKLab    */
+
+static inline void rgbToOklab(float r, float g, float b, float *lab) {
+    float l = cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+    float m = cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+    float s = cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+    lab[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+    lab[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+    lab[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+}
+
+static inline void oklabToRgb(const float *lab, float *rgb) {
+    float l = lab[0] + 0.3963377774f * lab[1] + 0.2158037573f * lab[2];
+    float m = lab[0] - 0.1055613458f * lab[1] - 0.0638541728f * lab[2];
+    float s = lab[0] - 0.0894841775f * lab[1] - 1.2914855480f * lab[2];
+    l = l * l * l;
+    m = m * m * m;
+    s = s * s * s;
+    rgb[0] = 4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s;
+    rgb[1] = -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s;
+    rgb[2] = -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s;
+}
+
+
+/*
+    Converts numPoints (B, G, R, A) sRGB points in place to the stored
+    (L, a, b) of space: L in the R byte, a in G, b in B.
+*/
+
+void pointsToColorSpace(unsigned char *points, long numPoints, int space) {
+    pthread_once(&tableOnce, buildLinearTable);
+    struct ColorSpaceScale sc = scales[space];
+
+    #pragma omp parallel for schedule(static)
+    for (long p = 0; p < numPoints; p++) {
+        unsigned char *point = &points[p*4];
+        float lab[3];
+        if (space == COLOR_OKLAB) {
+            rgbToOklab(linearTable[point[2]], linearTable[point[1]], linearTable[point[0]], lab);
+        }
+        else {
+            rgbToLab(linearTable[point[2]], linearTable[point[1]], linearTable[point[0]], lab);
+        }
+        point[2] = quantize(sc.scale * lab[0]);
+        point[1] = quantize(sc.scale * (lab[1] - sc.midA) + 128);
+        point[0] = quantize(sc.scale * (lab[2] - sc.midB) + 128);
+    }
+}
+
+void colorsToColorSpace(struct Color *colors, int n, int space) {
+    for (int j = 0; j < n; j++) {
+        unsigned char point[4] = { colors[j].B, colors[j].G, colors[j].R, 255 };
+        pointsToColorSpace(point, 1, space);
+        colors[j].B = point[0];
+        colors[j].G = point[1];
+        colors[j].R = point[2];
+    }
+}
+
+// Converts colors stored in space (centroids) back to sRGB
+void colorsToSRGB(struct Color *colors, int n, int space) {
+    struct ColorSpaceScale sc = scales[space];
+
+    for (int j = 0; j < n; j++) {
+        float lab[3] = {
+            colors[j].R / sc.scale,
+            (colors[j].G - 128) / sc.scale + sc.midA,
+            (colors[j].B - 128) / sc.scale + sc.midB
+        };
+        float rgb[3];
+        if (space == COLOR_OKLAB) {
+            oklabToRgb(lab, rgb);
+        }
+        else {
+            labToRgb(lab, rgb);
+        }
+        colors[j].R = encodeSRGB(rgb[0]);
+        colors[j].G = encodeSRGB(rgb[1]);
+        colors[j].B = encodeSRGB(rgb[2]);
+    }
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <omp.h>
+#include "kmeans.h"
+
+#define NUM_COLORS (1 << 24)
+#define NUM_WORDS (NUM_COLORS / 64)
+
+
+static inline int colorKey(const unsigned char *pixel) {
+    return (pixel[2] << 16) | (pixel[1] << 8) | pixel[0];
+}
+
+// Position of the color in the (sorted) table of unique colors
+static inline int colorIndex(struct ColorTable *table, int key) {
+    uint64_t word = table->present[key >> 6];
+    uint64_t below = word & ((1ULL << (key & 63)) - 1);
+    return table->rank[key >> 6] + __builtin_popcountll(below);
+}
+
+
+/*
+    Builds a weighted table of unique colors. A 2^24 bit presence bitmap (2 MB)
+    is filled from all pixels, a prefix count over its words then gives every
+    color its index in the table (a counting/radix sort on the 24-bit key).
+*/
+
+void buildColorTable(struct ColorTable *table, unsigned char *imageIn, long numPixels) {
+
+    table->present = calloc(NUM_WORDS, sizeof(uint64_t));
+    table->rank = malloc(NUM_WORDS * sizeof(int));
+
+    #pragma omp parallel for schedule(static)
+    for (long p = 0; p < numPixels; p++) {
+        int key = colorKey(&imageIn[p*4]);
+        #pragma omp atomic update
+        table->present[key >> 6] |= 1ULL << (key & 63);
+    }
+
+    int numColors = 0;
+    for (int w = 0; w < NUM_WORDS; w++) {
+        table->rank[w] = numColors;
+        numColors += __builtin_popcountll(table->present[w]);
+    }
+
+    table->numColors = numColors;
+    table->colors = malloc(numColors * 4 * sizeof(unsigned char));
+    table->weights = calloc(numColors, sizeof(int));
+
+    #pragma omp parallel for schedule(static)
+    for (int w = 0; w < NUM_WORDS; w++) {
+        uint64_t word = table->present[w];
+        int i = table->rank[w];
+        while (word) {
+            int key = w * 64 + __builtin_ctzll(word);
+            table->colors[i*4] = key & 0xFF;
+            table->colors[i*4+1] = (key >> 8) & 0xFF;
+            table->colors[i*4+2] = key >> 16;
+            table->colors[i*4+3] = 255;
+            word &= word - 1;
+            i++;
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (long p = 0; p < numPixels; p++) {
+        int i = colorIndex(table, colorKey(&imageIn[p*4]));
+        #pragma omp atomic update
+        table->weights[i]++;
+    }
+}
+
+
+/*
+    Maps every pixel to the cluster of its color
+*/
+
+void mapColorTable(struct ColorTable *table, unsigned char *imageIn, long numPixels, const void *colorClusters, void *c,
+                   int indexSize) {
+    #pragma omp parallel for schedule(static)
+    for (long p = 0; p < numPixels; p++) {
+        int cluster = getIndex(colorClusters, indexSize, colorIndex(table, colorKey(&imageIn[p*4])));
+        setIndex(c, indexSize, p, cluster);
+    }
+}
+
+
+void freeColorTable(struct ColorTable *table) {
+    free(table->present);
+    free(table->rank);
+    free(table->colors);
+    free(table->weights);
+}
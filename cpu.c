@@ -0,0 +1,761 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <omp.h>
+#include "kmeans.h"
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+
+/*
+    Nearest centroid search. Centroids are in SoA layout (cR, cG, cB) so one
+    load broadcasts a centroid channel to all lanes. All inputs are 8-bit, so
+    squared distances fit in 32-bit integers and the search is exact; ties go
+    to the lowest index, same as the OpenCL kernel.
+
+    The *Two variants also return the squared distances to the closest and
+    second closest centroid (for Hamerly bounds). Both variants of an
+    instruction set are generated from one always-inlined implementation.
+*/
+
+typedef void (*NearestFn)(const unsigned char *pixels, int *c, long n,
+                          const int *cR, const int *cG, const int *cB, int K);
+typedef void (*NearestTwoFn)(const unsigned char *pixels, int *c, long n,
+                             const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2);
+
+static inline __attribute__((always_inline))
+void nearestScalarImpl(const unsigned char *pixels, int *c, long n,
+                       const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    for (long p = 0; p < n; p++) {
+        int R = pixels[p*4+2];
+        int G = pixels[p*4+1];
+        int B = pixels[p*4];
+
+        int minDist = INT_MAX;
+        int secondDist = INT_MAX;
+        int minIndex = 0;
+
+        for (int i = 0; i < K; i++) {
+            int dB = cB[i] - B;
+            int dG = cG[i] - G;
+            int dR = cR[i] - R;
+
+            int dist = dB * dB + dG * dG + dR * dR;
+
+            if (dist < minDist) {
+                minIndex = i;
+                secondDist = minDist;
+                minDist = dist;
+            }
+            else if (dist2 && dist < secondDist) {
+                secondDist = dist;
+            }
+        }
+        c[p] = minIndex;
+        if (dist1) {
+            dist1[p] = minDist;
+            dist2[p] = secondDist;
+        }
+    }
+}
+
+static void nearestScalar(const unsigned char *pixels, int *c, long n,
+                          const int *cR, const int *cG, const int *cB, int K) {
+    nearestScalarImpl(pixels, c, n, cR, cG, cB, K, NULL, NULL);
+}
+
+static void nearestTwoScalar(const unsigned char *pixels, int *c, long n,
+                             const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    nearestScalarImpl(pixels, c, n, cR, cG, cB, K, dist1, dist2);
+}
+
+#ifdef HAVE_X86_SIMD
+
+// 4 pixels per step
+static inline __attribute__((always_inline, target("sse4.1")))
+void nearestSSEImpl(const unsigned char *pixels, int *c, long n,
+                    const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    long p = 0;
+    for (; p + 4 <= n; p += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)(pixels + p*4));
+        __m128i B = _mm_and_si128(px, mask);
+        __m128i G = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+        __m128i R = _mm_and_si128(_mm_srli_epi32(px, 16), mask);
+
+        __m128i minDist = _mm_set1_epi32(INT_MAX);
+        __m128i secondDist = _mm_set1_epi32(INT_MAX);
+        __m128i minIndex = _mm_setzero_si128();
+
+        for (int i = 0; i < K; i++) {
+            __m128i dB = _mm_sub_epi32(_mm_set1_epi32(cB[i]), B);
+            __m128i dG = _mm_sub_epi32(_mm_set1_epi32(cG[i]), G);
+            __m128i dR = _mm_sub_epi32(_mm_set1_epi32(cR[i]), R);
+            __m128i dist = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(dB, dB), _mm_mullo_epi32(dG, dG)),
+                                         _mm_mullo_epi32(dR, dR));
+
+            __m128i closer = _mm_cmplt_epi32(dist, minDist);
+            if (dist1) {
+                secondDist = _mm_blendv_epi8(_mm_min_epi32(dist, secondDist), minDist, closer);
+            }
+            minDist = _mm_min_epi32(dist, minDist);
+            minIndex = _mm_blendv_epi8(minIndex, _mm_set1_epi32(i), closer);
+        }
+        _mm_storeu_si128((__m128i *)(c + p), minIndex);
+        if (dist1) {
+            _mm_storeu_si128((__m128i *)(dist1 + p), minDist);
+            _mm_storeu_si128((__m128i *)(dist2 + p), secondDist);
+        }
+    }
+    nearestScalarImpl(pixels + p*4, c + p, n - p, cR, cG, cB, K, dist1 ? dist1 + p : NULL, dist2 ? dist2 + p : NULL);
+}
+
+__attribute__((target("sse4.1")))
+static void nearestSSE(const unsigned char *pixels, int *c, long n,
+                       const int *cR, const int *cG, const int *cB, int K) {
+    nearestSSEImpl(pixels, c, n, cR, cG, cB, K, NULL, NULL);
+}
+
+__attribute__((target("sse4.1")))
+static void nearestTwoSSE(const unsigned char *pixels, int *c, long n,
+                          const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    nearestSSEImpl(pixels, c, n, cR, cG, cB, K, dist1, dist2);
+}
+
+// 8 pixels per step
+static inline __attribute__((always_inline, target("avx2")))
+void nearestAVX2Impl(const unsigned char *pixels, int *c, long n,
+                     const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    long p = 0;
+    for (; p + 8 <= n; p += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i *)(pixels + p*4));
+        __m256i B = _mm256_and_si256(px, mask);
+        __m256i G = _mm256_and_si256(_mm256_srli_epi32(px, 8), mask);
+        __m256i R = _mm256_and_si256(_mm256_srli_epi32(px, 16), mask);
+
+        __m256i minDist = _mm256_set1_epi32(INT_MAX);
+        __m256i secondDist = _mm256_set1_epi32(INT_MAX);
+        __m256i minIndex = _mm256_setzero_si256();
+
+        for (int i = 0; i < K; i++) {
+            __m256i dB = _mm256_sub_epi32(_mm256_set1_epi32(cB[i]), B);
+            __m256i dG = _mm256_sub_epi32(_mm256_set1_epi32(cG[i]), G);
+            __m256i dR = _mm256_sub_epi32(_mm256_set1_epi32(cR[i]), R);
+            __m256i dist = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dB, dB), _mm256_mullo_epi32(dG, dG)),
+                                            _mm256_mullo_epi32(dR, dR));
+
+            __m256i closer = _mm256_cmpgt_epi32(minDist, dist);
+            if (dist1) {
+                secondDist = _mm256_blendv_epi8(_mm256_min_epi32(dist, secondDist), minDist, closer);
+            }
+            minDist = _mm256_min_epi32(dist, minDist);
+            minIndex = _mm256_blendv_epi8(minIndex, _mm256_set1_epi32(i), closer);
+        }
+        _mm256_storeu_si256((__m256i *)(c + p), minIndex);
+        if (dist1) {
+            _mm256_storeu_si256((__m256i *)(dist1 + p), minDist);
+            _mm256_storeu_si256((__m256i *)(dist2 + p), secondDist);
+        }
+    }
+    nearestScalarImpl(pixels + p*4, c + p, n - p, cR, cG, cB, K, dist1 ? dist1 + p : NULL, dist2 ? dist2 + p : NULL);
+}
+
+__attribute__((target("avx2")))
+static void nearestAVX2(const unsigned char *pixels, int *c, long n,
+                        const int *cR, const int *cG, const int *cB, int K) {
+    nearestAVX2Impl(pixels, c, n, cR, cG, cB, K, NULL, NULL);
+}
+
+__attribute__((target("avx2")))
+static void nearestTwoAVX2(const unsigned char *pixels, int *c, long n,
+                           const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    nearestAVX2Impl(pixels, c, n, cR, cG, cB, K, dist1, dist2);
+}
+
+// 16 pixels per step
+static inline __attribute__((always_inline, target("avx512f")))
+void nearestAVX512Impl(const unsigned char *pixels, int *c, long n,
+                       const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    const __m512i mask = _mm512_set1_epi32(0xFF);
+    long p = 0;
+    for (; p + 16 <= n; p += 16) {
+        __m512i px = _mm512_loadu_si512((const void *)(pixels + p*4));
+        __m512i B = _mm512_and_si512(px, mask);
+        __m512i G = _mm512_and_si512(_mm512_srli_epi32(px, 8), mask);
+        __m512i R = _mm512_and_si512(_mm512_srli_epi32(px, 16), mask);
+
+        __m512i minDist = _mm512_set1_epi32(INT_MAX);
+        __m512i secondDist = _mm512_set1_epi32(INT_MAX);
+        __m512i minIndex = _mm512_setzero_si512();
+
+        for (int i = 0; i < K; i++) {
+            __m512i dB = _mm512_sub_epi32(_mm512_set1_epi32(cB[i]), B);
+            __m512i dG = _mm512_sub_epi32(_mm512_set1_epi32(cG[i]), G);
+            __m512i dR = _mm512_sub_epi32(_mm512_set1_epi32(cR[i]), R);
+            __m512i dist = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(dB, dB), _mm512_mullo_epi32(dG, dG)),
+                                            _mm512_mullo_epi32(dR, dR));
+
+            __mmask16 closer = _mm512_cmplt_epi32_mask(dist, minDist);
+            if (dist1) {
+                secondDist = _mm512_mask_mov_epi32(_mm512_min_epi32(dist, secondDist), closer, minDist);
+            }
+            minDist = _mm512_min_epi32(dist, minDist);
+            minIndex = _mm512_mask_mov_epi32(minIndex, closer, _mm512_set1_epi32(i));
+        }
+        _mm512_storeu_si512((void *)(c + p), minIndex);
+        if (dist1) {
+            _mm512_storeu_si512((void *)(dist1 + p), minDist);
+            _mm512_storeu_si512((void *)(dist2 + p), secondDist);
+        }
+    }
+    nearestScalarImpl(pixels + p*4, c + p, n - p, cR, cG, cB, K, dist1 ? dist1 + p : NULL, dist2 ? dist2 + p : NULL);
+}
+
+__attribute__((target("avx512f")))
+static void nearestAVX512(const unsigned char *pixels, int *c, long n,
+                          const int *cR, const int *cG, const int *cB, int K) {
+    nearestAVX512Impl(pixels, c, n, cR, cG, cB, K, NULL, NULL);
+}
+
+__attribute__((target("avx512f")))
+static void nearestTwoAVX512(const unsigned char *pixels, int *c, long n,
+                             const int *cR, const int *cG, const int *cB, int K, int *dist1, int *dist2) {
+    nearestAVX512Impl(pixels, c, n, cR, cG, cB, K, dist1, dist2);
+}
+
+#endif
+
+
+/*
+    Picks the widest nearest centroid search the CPU supports
+*/
+
+static NearestFn selectNearest(NearestTwoFn *nearestTwo, const char **name) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        *name = "avx512";
+        *nearestTwo = nearestTwoAVX512;
+        return nearestAVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        *nearestTwo = nearestTwoAVX2;
+        return nearestAVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        *name = "sse4.1";
+        *nearestTwo = nearestTwoSSE;
+        return nearestSSE;
+    }
+#endif
+    *name = "scalar";
+    *nearestTwo = nearestTwoScalar;
+    return nearestScalar;
+}
+
+
+const char *cpuSimdName(void) {
+    const char *name;
+    NearestTwoFn nearestTwo;
+    selectNearest(&nearestTwo, &name);
+    return name;
+}
+
+
+/*
+    Assigns points in [start, end) to closest cluster and accumulates
+    (Rsum, Gsum, Bsum, pixelCount) into the thread's partial clusterCount
+*/
+
+static void assignToCluster(NearestFn nearest, unsigned char *points, int *weights, int *c, int *centroidsSoA,
+                            long long *clusterCount, long start, long end, int K) {
+    nearest(points + start*4, c + start, end - start, centroidsSoA, centroidsSoA + K, centroidsSoA + 2*K, K);
+
+    for (long p = start; p < end; p++) {
+        int cluster = c[p];
+        long long weight = weights ? weights[p] : 1;
+        clusterCount[4*cluster] += weight * points[p*4+2];
+        clusterCount[4*cluster+1] += weight * points[p*4+1];
+        clusterCount[4*cluster+2] += weight * points[p*4];
+        clusterCount[4*cluster+3] += weight;
+    }
+}
+
+
+/*
+    Hamerly bounds. A point keeps its cluster without scanning all K centroids
+    while the upper bound on the distance to its centroid is below both the
+    lower bound on the distance to every other centroid and half the distance
+    from its centroid to the closest other one. Bounds are widened by
+    BOUND_EPS on every update so float rounding can never make a skip wrong,
+    which keeps assignments identical to the brute-force search.
+*/
+
+#define BOUND_EPS 1e-3f
+
+struct Bounds {
+    float *upper;       // upper bound on distance to assigned centroid, per point
+    float *lower;       // lower bound on distance to any other centroid, per point
+    float *drift;       // distance each centroid moved in the last update
+    float *otherDrift;  // largest drift among all other centroids
+    float *halfDist;    // half the distance to the closest other centroid
+};
+
+// Points needing a full scan are gathered in blocks and searched with the SIMD kernel
+#define SCAN_BLOCK 1024
+
+static void assignHamerly(NearestTwoFn nearestTwo, unsigned char *points, int *weights, int *c,
+                          int *centroidsSoA, struct Bounds *bounds, long long *clusterCount, long start, long end, int K) {
+    long scanIndex[SCAN_BLOCK];
+    unsigned char scanPixels[SCAN_BLOCK * 4];
+    int scanCluster[SCAN_BLOCK];
+    int scanDist1[SCAN_BLOCK];
+    int scanDist2[SCAN_BLOCK];
+
+    const int *cR = centroidsSoA;
+    const int *cG = centroidsSoA + K;
+    const int *cB = centroidsSoA + 2*K;
+
+    for (long blockStart = start; blockStart < end; blockStart += SCAN_BLOCK) {
+        long blockEnd = blockStart + SCAN_BLOCK < end ? blockStart + SCAN_BLOCK : end;
+        int numScan = 0;
+
+        for (long p = blockStart; p < blockEnd; p++) {
+            int a = c[p];
+            float u = bounds->upper[p] + bounds->drift[a] + BOUND_EPS;
+            float l = bounds->lower[p] - bounds->otherDrift[a] - BOUND_EPS;
+            float m = fmaxf(bounds->halfDist[a], l);
+
+            if (u >= m) {
+                // Tighten upper bound
+                int dB = cB[a] - points[p*4];
+                int dG = cG[a] - points[p*4+1];
+                int dR = cR[a] - points[p*4+2];
+                u = sqrtf(dB * dB + dG * dG + dR * dR) + BOUND_EPS;
+
+                if (u >= m) {
+                    scanIndex[numScan] = p;
+                    memcpy(&scanPixels[numScan*4], &points[p*4], 4);
+                    numScan++;
+                }
+            }
+            bounds->upper[p] = u;
+            bounds->lower[p] = l;
+        }
+
+        // Full scan for closest and second closest centroid
+        nearestTwo(scanPixels, scanCluster, numScan, cR, cG, cB, K, scanDist1, scanDist2);
+        for (int j = 0; j < numScan; j++) {
+            long p = scanIndex[j];
+            c[p] = scanCluster[j];
+            bounds->upper[p] = sqrtf(scanDist1[j]) + BOUND_EPS;
+            bounds->lower[p] = sqrtf(scanDist2[j]) - BOUND_EPS;
+        }
+
+        for (long p = blockStart; p < blockEnd; p++) {
+            int cluster = c[p];
+            long long weight = weights ? weights[p] : 1;
+            clusterCount[4*cluster] += weight * points[p*4+2];
+            clusterCount[4*cluster+1] += weight * points[p*4+1];
+            clusterCount[4*cluster+2] += weight * points[p*4];
+            clusterCount[4*cluster+3] += weight;
+        }
+    }
+}
+
+/*
+    Half distance to the closest other centroid and largest drift of the other
+    centroids, for each centroid
+*/
+
+static void updateBounds(struct Bounds *bounds, struct Color *centroids, int K) {
+    for (int i = 0; i < K; i++) {
+        int minDist = INT_MAX;
+        float maxDrift = 0;
+        for (int j = 0; j < K; j++) {
+            if (j == i) {
+                continue;
+            }
+            int dB = centroids[j].B - centroids[i].B;
+            int dG = centroids[j].G - centroids[i].G;
+            int dR = centroids[j].R - centroids[i].R;
+            int dist = dB * dB + dG * dG + dR * dR;
+            if (dist < minDist) {
+                minDist = dist;
+            }
+            maxDrift = fmaxf(maxDrift, bounds->drift[j]);
+        }
+        bounds->halfDist[i] = 0.5f * sqrtf(minDist) - BOUND_EPS;
+        bounds->otherDrift[i] = maxDrift;
+    }
+}
+
+
+/*
+    Updates clusters (centroid positions), same as updateCentroids in kernels.cl.
+    Returns the largest squared centroid shift.
+*/
+
+static int updateCentroids(struct Color *centroids, long long *clusterCount, int *c, int *randIndexes,
+                            unsigned char *points, struct Bounds *bounds, int K) {
+    int maxShift = 0;
+    for (int i = 0; i < K; i++) {
+        long long count = clusterCount[4*i+3];
+
+        if (count == 0) {
+            // Fix empty cluster
+            long randIndex = randIndexes[i];
+            c[randIndex] = i;
+            if (bounds) {
+                // Bounds belong to the old cluster, force a full scan
+                bounds->upper[randIndex] = INFINITY;
+                bounds->lower[randIndex] = 0;
+            }
+
+            clusterCount[4*i] += points[randIndex*4+2];
+            clusterCount[4*i+1] += points[randIndex*4+1];
+            clusterCount[4*i+2] += points[randIndex*4];
+            clusterCount[4*i+3]++;
+
+            count = 1;
+        }
+        struct Color old = centroids[i];
+
+        centroids[i].B = clusterCount[4*i+2] / count;
+        centroids[i].G = clusterCount[4*i+1] / count;
+        centroids[i].R = clusterCount[4*i] / count;
+
+        int dB = centroids[i].B - old.B;
+        int dG = centroids[i].G - old.G;
+        int dR = centroids[i].R - old.R;
+        int shift = dB * dB + dG * dG + dR * dR;
+        if (shift > maxShift) {
+            maxShift = shift;
+        }
+        if (bounds) {
+            bounds->drift[i] = sqrtf(shift);
+        }
+    }
+    return maxShift;
+}
+
+
+/*
+    Mini-batch k-means, same as assignBatch and updateMiniBatch in kernels.cl:
+    every iteration draws batchSize points, assigns them and moves each
+    centroid towards the mean of its share with learning rate count / total
+    points seen. One full assignment pass at the end fills c.
+*/
+
+// Point index of batch item i, same as batchIndex in kernels.cl
+static inline int batchIndex(unsigned int seed, unsigned int iteration, unsigned int i, unsigned int n) {
+    unsigned int x = seed ^ ((iteration * 0x01000193u + i) * 0x9E3779B9u);
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x % n;
+}
+
+static double cpuMiniBatch(unsigned char *points, int *weights, long numPoints, void *indexes,
+                           struct Color *centroids, struct KMeansParams *params, int *iterations) {
+    int K = params->K;
+    int *c = indexes;
+    int batchSize = params->batchSize < numPoints ? params->batchSize : numPoints;
+    unsigned int seed = rand();
+
+    unsigned char *batch = malloc(batchSize * 4);
+    int *batchC = malloc(batchSize * sizeof(int));
+    int *batchWeights = weights ? malloc(batchSize * sizeof(int)) : NULL;
+    long long *clusterCount = malloc(K * 4 * sizeof(long long));
+    long long *totals = calloc(K, sizeof(long long));
+    float *centers = malloc(K * 3 * sizeof(float));
+    int *centroidsSoA = malloc(K * 3 * sizeof(int));
+
+    const char *simdName;
+    NearestTwoFn nearestTwo;
+    NearestFn nearest = selectNearest(&nearestTwo, &simdName);
+
+    for (int j = 0; j < K; j++) {
+        centers[j*3] = centroids[j].R;
+        centers[j*3+1] = centroids[j].G;
+        centers[j*3+2] = centroids[j].B;
+    }
+
+    double startTime = omp_get_wtime();
+
+    for (int i = 0; i < params->I; i++) {
+        for (int j = 0; j < K; j++) {
+            centroidsSoA[j] = centroids[j].R;
+            centroidsSoA[K + j] = centroids[j].G;
+            centroidsSoA[2*K + j] = centroids[j].B;
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (int b = 0; b < batchSize; b++) {
+            long p = batchIndex(seed, i, b, numPoints);
+            memcpy(&batch[b*4], &points[p*4], 4);
+            if (weights) {
+                batchWeights[b] = weights[p];
+            }
+        }
+
+        memset(clusterCount, 0, K * 4 * sizeof(long long));
+        assignToCluster(nearest, batch, batchWeights, batchC, centroidsSoA, clusterCount, 0, batchSize, K);
+
+        for (int j = 0; j < K; j++) {
+            long long count = clusterCount[4*j+3];
+            if (count == 0) {
+                continue;
+            }
+            totals[j] += count;
+            float rate = (float) count / totals[j];
+            for (int ch = 0; ch < 3; ch++) {
+                float mean = (float) clusterCount[4*j+ch] / count;
+                centers[3*j+ch] += rate * (mean - centers[3*j+ch]);
+            }
+            centroids[j].R = (unsigned char) (centers[3*j] + 0.5f);
+            centroids[j].G = (unsigned char) (centers[3*j+1] + 0.5f);
+            centroids[j].B = (unsigned char) (centers[3*j+2] + 0.5f);
+        }
+    }
+    *iterations = params->I;
+
+    for (int j = 0; j < K; j++) {
+        centroidsSoA[j] = centroids[j].R;
+        centroidsSoA[K + j] = centroids[j].G;
+        centroidsSoA[2*K + j] = centroids[j].B;
+    }
+
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int teamSize = omp_get_num_threads();
+        long chunk = (numPoints + teamSize - 1) / teamSize;
+        long start = tid * chunk;
+        long end = start + chunk < numPoints ? start + chunk : numPoints;
+        if (start < end) {
+            nearest(points + start*4, c + start, end - start, centroidsSoA, centroidsSoA + K, centroidsSoA + 2*K, K);
+        }
+    }
+
+    if (params->indexSize < (int) sizeof(int)) {
+        for (long p = 0; p < numPoints; p++) {
+            setIndex(indexes, params->indexSize, p, c[p]);
+        }
+    }
+
+    double elapsed = omp_get_wtime() - startTime;
+
+    free(batch);
+    free(batchC);
+    free(batchWeights);
+    free(clusterCount);
+    free(totals);
+    free(centers);
+    free(centroidsSoA);
+
+    return elapsed;
+}
+
+
+/*
+    Runs K-means on all available cores. Every thread accumulates into its own
+    partial clusterCount, partials are summed once per iteration.
+    Returns time spent clustering.
+*/
+
+double cpuKMeans(unsigned char *points, int *weights, long numPoints, void *indexes, struct Color *centroids,
+                 struct KMeansParams *params, int *iterations) {
+
+    int K = params->K;
+    int *c = indexes;
+    int numThreads = omp_get_max_threads();
+
+    if (params->batchSize) {
+        return cpuMiniBatch(points, weights, numPoints, indexes, centroids, params, iterations);
+    }
+
+    long long *clusterCount = malloc(K * 4 * sizeof(long long));              // (Rsum, Gsum, Bsum, pixelCount) for each cluster, 64-bit for large images
+    long long *partialCount = malloc(numThreads * K * 4 * sizeof(long long)); // clusterCount of each thread
+    int *randIndexes = malloc(K * sizeof(int));
+    int *centroidsSoA = malloc(K * 3 * sizeof(int));                          // all R, then all G, then all B
+
+    const char *simdName;
+    NearestTwoFn nearestTwo;
+    NearestFn nearest = selectNearest(&nearestTwo, &simdName);
+
+    // Start with no usable bounds, so the first iteration scans every point
+    struct Bounds bounds;
+    struct Bounds *boundsPtr = NULL;
+    if (params->assign == ASSIGN_HAMERLY) {
+        bounds.upper = malloc((size_t) numPoints * sizeof(float));
+        bounds.lower = calloc(numPoints, sizeof(float));
+        bounds.drift = calloc(K, sizeof(float));
+        bounds.otherDrift = calloc(K, sizeof(float));
+        bounds.halfDist = calloc(K, sizeof(float));
+        for (long p = 0; p < numPoints; p++) {
+            bounds.upper[p] = INFINITY;
+            c[p] = 0;
+        }
+        boundsPtr = &bounds;
+    }
+
+    double startTime = omp_get_wtime();
+
+    int i = 0;
+    while (i < params->I) {
+
+        for (int j = 0; j < K; j++) {
+            centroidsSoA[j] = centroids[j].R;
+            centroidsSoA[K + j] = centroids[j].G;
+            centroidsSoA[2*K + j] = centroids[j].B;
+        }
+        memset(partialCount, 0, numThreads * K * 4 * sizeof(long long));
+
+        #pragma omp parallel num_threads(numThreads)
+        {
+            int tid = omp_get_thread_num();
+            long long *local = &partialCount[tid * K * 4];
+
+            // Static split into contiguous chunks, one per thread
+            int teamSize = omp_get_num_threads();
+            long chunk = (numPoints + teamSize - 1) / teamSize;
+            long start = tid * chunk;
+            long end = start + chunk < numPoints ? start + chunk : numPoints;
+            if (start < end && boundsPtr) {
+                assignHamerly(nearestTwo, points, weights, c, centroidsSoA, boundsPtr, local, start, end, K);
+            }
+            else if (start < end) {
+                assignToCluster(nearest, points, weights, c, centroidsSoA, local, start, end, K);
+            }
+
+            #pragma omp barrier
+
+            // Reduce partials
+            #pragma omp for schedule(static)
+            for (int j = 0; j < K * 4; j++) {
+                long long sum = 0;
+                for (int t = 0; t < numThreads; t++) {
+                    sum += partialCount[t * K * 4 + j];
+                }
+                clusterCount[j] = sum;
+            }
+        }
+
+        // Generate sequence of random point indexes (for fixing empty clusters)
+        for (int j = 0; j < K; j++) {
+            randIndexes[j] = rand() % numPoints;
+        }
+
+        int maxShift = updateCentroids(centroids, clusterCount, c, randIndexes, points, boundsPtr, K);
+        if (boundsPtr) {
+            updateBounds(boundsPtr, centroids, K);
+        }
+        i++;
+
+        if (params->tolerance >= 0 && maxShift <= params->tolerance * params->tolerance) {
+            break;
+        }
+    }
+    *iterations = i;
+
+    // Narrow to params->indexSize bytes in place, index p never overwrites a later int
+    if (params->indexSize < (int) sizeof(int)) {
+        for (long p = 0; p < numPoints; p++) {
+            setIndex(indexes, params->indexSize, p, c[p]);
+        }
+    }
+
+    double elapsed = omp_get_wtime() - startTime;
+
+    free(clusterCount);
+    free(partialCount);
+    free(randIndexes);
+    free(centroidsSoA);
+    if (boundsPtr) {
+        free(bounds.upper);
+        free(bounds.lower);
+        free(bounds.drift);
+        free(bounds.otherDrift);
+        free(bounds.halfDist);
+    }
+
+    return elapsed;
+}
+
+
+/*
+    One pyramid level, same as downsample in kernels.cl: every point is the
+    rounded mean of a 2x2 block of the level below, edge pixels are repeated
+    for odd sizes.
+*/
+
+static void downsample(const unsigned char *src, int srcWidth, int srcHeight, unsigned char *dst) {
+    int width = (srcWidth + 1) / 2;
+    int height = (srcHeight + 1) / 2;
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        long y0 = 2L * y * srcWidth;
+        long y1 = (long) (2 * y + 1 < srcHeight ? 2 * y + 1 : srcHeight - 1) * srcWidth;
+        for (int x = 0; x < width; x++) {
+            int x0 = 2 * x;
+            int x1 = 2 * x + 1 < srcWidth ? 2 * x + 1 : srcWidth - 1;
+            for (int ch = 0; ch < 4; ch++) {
+                int sum = src[(y0 + x0) * 4 + ch] + src[(y0 + x1) * 4 + ch] +
+                          src[(y1 + x0) * 4 + ch] + src[(y1 + x1) * 4 + ch];
+                dst[((long) y * width + x) * 4 + ch] = (sum + 2) >> 2;
+            }
+        }
+    }
+}
+
+
+/*
+    Coarse-to-fine mode, same as gpuKMeansPyramid: runs most iterations on
+    the coarsest of levels downsampled copies of the image and refines the
+    centroids on every finer level. c doubles as scratch for the coarse
+    levels. iterations is set to the total over all levels.
+*/
+
+double cpuKMeansPyramid(unsigned char *points, int width, int height, int levels, void *c, struct Color *centroids,
+                        struct KMeansParams *params, int *iterations) {
+    unsigned char *pyramid[PYRAMID_MAX + 1] = { points };
+    int widths[PYRAMID_MAX + 1] = { width };
+    int heights[PYRAMID_MAX + 1] = { height };
+
+    double startTime = omp_get_wtime();
+
+    for (int l = 1; l <= levels; l++) {
+        widths[l] = (widths[l-1] + 1) / 2;
+        heights[l] = (heights[l-1] + 1) / 2;
+        pyramid[l] = malloc((size_t) widths[l] * heights[l] * 4);
+        downsample(pyramid[l-1], widths[l-1], heights[l-1], pyramid[l]);
+    }
+
+    struct KMeansParams levelParams = *params;
+    *iterations = 0;
+
+    for (int l = levels; l >= 0; l--) {
+        int levelIterations;
+        levelParams.I = pyramidIterations(params->I, levels, l);
+        cpuKMeans(pyramid[l], NULL, (long) widths[l] * heights[l], c, centroids, &levelParams, &levelIterations);
+        *iterations += levelIterations;
+    }
+
+    for (int l = 1; l <= levels; l++) {
+        free(pyramid[l]);
+    }
+
+    return omp_get_wtime() - startTime;
+}
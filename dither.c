@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <sched.h>
+#include <omp.h>
+#include "kmeans.h"
+
+#define FS_BLOCK 64                     // pixels a Floyd-Steinberg row publishes its progress after
+
+// 8x8 Bayer matrix, same as in kernels.cl
+static const unsigned char bayer[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+
+/*
+    Nearest palette color of every cell of a 64x64x64 grid over RGB, looked
+    up by the top PALETTE_TABLE_BITS bits of each channel (paletteIndex).
+    Exact at the cell centers, at most 2 units off per channel elsewhere.
+*/
+
+void buildPaletteTable(int *table, const struct Color *palette, int K) {
+    int cells = 1 << PALETTE_TABLE_BITS;
+    int shift = 8 - PALETTE_TABLE_BITS;
+    int half = 1 << (shift - 1);
+
+    #pragma omp parallel for schedule(static)
+    for (int r = 0; r < cells; r++) {
+        for (int g = 0; g < cells; g++) {
+            for (int b = 0; b < cells; b++) {
+                int R = (r << shift) + half, G = (g << shift) + half, B = (b << shift) + half;
+                int minDist = INT_MAX;
+                int minIndex = 0;
+                for (int j = 0; j < K; j++) {
+                    int dR = palette[j].R - R;
+                    int dG = palette[j].G - G;
+                    int dB = palette[j].B - B;
+                    int dist = dR * dR + dG * dG + dB * dB;
+                    if (dist < minDist) {
+                        minDist = dist;
+                        minIndex = j;
+                    }
+                }
+                table[(r * cells + g) * cells + b] = minIndex;
+            }
+        }
+    }
+}
+
+// Amplitude of ordered dithering: mean distance from a palette color to its closest neighbour
+float paletteSpread(const struct Color *palette, int K) {
+    double sum = 0;
+    for (int i = 0; i < K; i++) {
+        int minDist = INT_MAX;
+        for (int j = 0; j < K; j++) {
+            int dR = palette[j].R - palette[i].R;
+            int dG = palette[j].G - palette[i].G;
+            int dB = palette[j].B - palette[i].B;
+            int dist = dR * dR + dG * dG + dB * dB;
+            if (j != i && dist < minDist) {
+                minDist = dist;
+            }
+        }
+        sum += sqrt(minDist);
+    }
+    return sum / K;
+}
+
+static inline int clamp255(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+
+/*
+    Ordered dithering, same as ditherOrdered in kernels.cl: every pixel is
+    offset by a threshold in [-spread/2, spread/2) from the Bayer matrix or
+    from interleaved gradient noise (a cheap blue-noise-like pattern)
+    before the palette lookup. Pixels are independent.
+*/
+
+static void ditherOrdered(const unsigned char *imageIn, int width, int height, const int *table, float spread,
+                          void *c, int indexSize, int mode) {
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float t;
+            if (mode == DITHER_BAYER) {
+                t = (bayer[y & 7][x & 7] + 0.5f) / 64;
+            }
+            else {
+                float f = 0.06711056f * x + 0.00583715f * y;
+                f = 52.9829189f * (f - floorf(f));
+                t = f - floorf(f);
+            }
+            int offset = (int) floorf((t - 0.5f) * spread + 0.5f);
+            const unsigned char *pixel = &imageIn[((size_t) y * width + x) * 4];
+            int R = clamp255(pixel[2] + offset);
+            int G = clamp255(pixel[1] + offset);
+            int B = clamp255(pixel[0] + offset);
+            setIndex(c, indexSize, (long) y * width + x, table[paletteIndex(R, G, B)]);
+        }
+    }
+}
+
+
+/*
+    Floyd-Steinberg error diffusion in parallel. Rows go round robin to the
+    threads, a row may handle pixel x once the row above has finished
+    pixel x + 1, the last one diffusing error into it, so all threads work
+    at once on a diagonal front. Rows publish their progress every FS_BLOCK
+    pixels. Error into a row is kept in a ring of row buffers, in
+    sixteenths; the reader clears every entry it takes.
+*/
+
+static void ditherFloydSteinberg(const unsigned char *imageIn, int width, int height, const int *table,
+                                 const struct Color *palette, void *c, int indexSize) {
+    int numThreads = omp_get_max_threads();
+    int ringSize = numThreads + 2;
+    int *errors = calloc((size_t) ringSize * (width + 2) * 3, sizeof(int));
+    int *progress = calloc(height, sizeof(int));
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        int tid = omp_get_thread_num();
+        int teamSize = omp_get_num_threads();
+
+        for (int y = tid; y < height; y += teamSize) {
+            // Error into this row and into the next, offset by one so x - 1 never underflows
+            int *in = &errors[(size_t) (y % ringSize) * (width + 2) * 3 + 3];
+            int *out = &errors[(size_t) ((y + 1) % ringSize) * (width + 2) * 3 + 3];
+            int right[3] = {0, 0, 0};
+
+            for (int x0 = 0; x0 < width; x0 += FS_BLOCK) {
+                int x1 = x0 + FS_BLOCK < width ? x0 + FS_BLOCK : width;
+                if (y > 0) {
+                    int need = x1 + 1 < width ? x1 + 1 : width;
+                    while (__atomic_load_n(&progress[y-1], __ATOMIC_ACQUIRE) < need) {
+                        sched_yield();
+                    }
+                }
+
+                for (int x = x0; x < x1; x++) {
+                    const unsigned char *pixel = &imageIn[((size_t) y * width + x) * 4];
+                    int value[3];
+                    for (int ch = 0; ch < 3; ch++) {
+                        int err = right[ch] + in[x*3+ch];
+                        in[x*3+ch] = 0;
+                        value[ch] = clamp255(pixel[2-ch] + (err >= 0 ? (err + 8) >> 4 : -((-err + 8) >> 4)));
+                    }
+                    int index = table[paletteIndex(value[0], value[1], value[2])];
+                    setIndex(c, indexSize, (long) y * width + x, index);
+
+                    int chosen[3] = { palette[index].R, palette[index].G, palette[index].B };
+                    for (int ch = 0; ch < 3; ch++) {
+                        int err = value[ch] - chosen[ch];
+                        right[ch] = 7 * err;
+                        out[(x-1)*3+ch] += 3 * err;
+                        out[x*3+ch] += 5 * err;
+                        out[(x+1)*3+ch] += err;
+                    }
+                }
+                __atomic_store_n(&progress[y], x1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    free(progress);
+    free(errors);
+}
+
+
+/*
+    Remaps every pixel of the (B, G, R, A) image to the palette with
+    dithering, writing the indexes to c. Returns the time spent.
+*/
+
+double ditherImage(const unsigned char *imageIn, int width, int height, const struct Color *palette, int K,
+                   void *c, int indexSize, int mode) {
+    double startTime = omp_get_wtime();
+
+    int *table = malloc(PALETTE_TABLE_SIZE * sizeof(int));
+    buildPaletteTable(table, palette, K);
+
+    if (mode == DITHER_FS) {
+        ditherFloydSteinberg(imageIn, width, height, table, palette, c, indexSize);
+    }
+    else {
+        ditherOrdered(imageIn, width, height, table, paletteSpread(palette, K), c, indexSize, mode);
+    }
+
+    free(table);
+    return omp_get_wtime() - startTime;
+}
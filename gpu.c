@@ -1,25 +1,207 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <CL/cl.h> 
 #include <omp.h>
+#include <pthread.h>
 #include "FreeImage.h"
+#include "kmeans.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <math.h>
+#include <dirent.h>
+#include <glob.h>
+#include <libgen.h>
 
 #include <unistd.h>
 #include <ctype.h>
 
-#define MAX_SOURCE_SIZE	16384
+#define MAX_PATH 4096
+
+// kernels.cl is assembled into the binary at build time (NUL terminated), so the program runs from any directory
+__asm__(".section .rodata\n"
+        ".global kernelSource\n"
+        "kernelSource:\n"
+        ".incbin \"kernels.cl\"\n"
+        ".byte 0\n"
+        ".previous\n");
+extern const char kernelSource[];
+
+#define BACKEND_GPU 0
+#define BACKEND_CPU 1
+
+#define INIT_RANDOM 0
+#define INIT_PARALLEL 1
+
+#define QUEUE_DEPTH 4
+
+// Iterations worth of random indexes (for fixing empty clusters) uploaded with one write
+#define RAND_CHUNK 64
+
+// Settings for compressing an image, shared by all images of a batch
+struct Options {
+    struct KMeansParams params;
+    int backend;
+    int init;                           // -i, INIT_RANDOM or INIT_PARALLEL (k-means||)
+    int colorSpace;                     // -c, COLOR_RGB, COLOR_OKLAB or COLOR_LAB
+    int dither;                         // -D, DITHER_NONE, DITHER_FS, DITHER_BAYER or DITHER_NOISE
+    int compact;
+    unsigned int seed;
+    int bandRows;                       // -B, bound device memory to bands of this many rows, host buffers stay full size, 0 = whole image
+    int pyramidLevels;                  // -P, downsampled levels of coarse-to-fine mode, 0 = full resolution only
+    int palette;                        // -p, save 8-bit palettized PNGs
+    int pngThreads;                     // -z, threads of the zlib PNG codec per image, 0 = FreeImage
+    int rawWidth;                       // -g, dimensions of headerless raw frames
+    int rawHeight;
+    int indexOutput;                    // -x, save raw index maps and palettes instead of PNGs
+};
+
+// OpenCL engine settings
+struct GPUOptions {
+    int deviceID;
+    int showDevices;
+    int fused;                          // -f, whole iterations in one launch
+    int treeReduce;                     // -r tree, per work-group partial sums and a reduction kernel
+    const char *kernelFile;             // -k, NULL for the embedded kernels
+};
+
+// One input/output pair of a batch
+struct Job {
+    char *inputFile;
+    char *outputFile;
+};
+
+// An image on its way through the pipeline (decode -> cluster -> encode)
+struct Image {
+    int index;                          // position in the batch
+    int width;
+    int height;
+    int pitch;
+    unsigned char *imageIn;             // NULL if the image could not be loaded
+    int rawInput;                       // loaded by rawLoad, imageIn is page aligned
+    size_t mapped;                      // imageIn is a mapping of the input file of this size, see rawUnload
+    FIBITMAP *bitmap;                   // loaded by FreeImage, imageIn points to its bits
+    FIBITMAP *outBitmap;                // output image built on the device, or NULL
+    unsigned char *imageOut;            // same as (R, G, B) rows for the zlib codec
+
+    struct ColorTable colorTable;       // only with -u
+    unsigned char *points;              // points to cluster, imageIn or the unique colors
+    int *weights;
+    long numPoints;
+    void *pointClusters;
+
+    void *c;                            // cluster number for each pixel, params.indexSize bytes each
+    size_t cMapped;                     // -x: c is a mapping of the output file of this size, see rawSaveIndexes
+    struct Color *centroids;            // centroids (B, G, R)
+
+    double startTime;
+    double decodeTime;                  // loading the image, without compaction
+    double encodeTime;                  // building and saving the output image
+    double compactTime;
+    double seedTime;                    // k-means|| seeding, only with -i parallel
+    double ditherTime;                  // only with -D
+    double elapsed;                     // clustering time
+    int iterations;
+};
+
+// Per point device buffers. There are two, so the next image can be uploaded while the current one is clustered
+struct GPUSlot {
+    long capacity;                      // only reallocated when an image has more points
+    long numPoints;
+    int weighted;
+    cl_mem imageIn_d;
+    cl_mem weights_d;
+    cl_mem c_d;
+    cl_mem bounds_d[2];                 // Hamerly bounds per point (upper, lower)
+    cl_mem partials_d;                  // tree reduction: cluster sums of every work-group
+    int hostImage;                      // imageIn_d wraps the host points (CL_MEM_USE_HOST_PTR), NULL once clustered
+    cl_event uploaded;
+};
+
+// OpenCL state shared by all images of a batch
+struct GPUEngine {
+    cl_context context;
+    cl_command_queue commandQueue;      // kernels and results
+    cl_command_queue uploadQueue;       // uploads of the next image
+    cl_program program;
+    cl_kernel kernel;                   // assignToCluster / assignToClusterHamerly
+    cl_kernel kernel2;                  // updateCentroids
+    cl_kernel boundsKernel;             // Hamerly mode: updateClusterBounds
+    int K;
+    int hamerly;
+    int fused;                          // kernel runs whole iterations (kmeansIteration), kernel2 unused
+    int treeReduce;                     // kernel writes partials_d, reduceKernel sums them into clusterCount_d
+    int int64Atomics;                   // device has cl_khr_int64_base_atomics, work-group counters are 64-bit atomics
+    int indexSize;                      // bytes per cluster index in c_d
+    cl_kernel reduceKernel;             // reducePartials
+    cl_kernel mapKernel;                // mapColors
+    cl_kernel downsampleKernel;         // coarse-to-fine mode: downsample
+    cl_kernel ditherKernel;             // ditherOrdered
+    cl_mem paletteTable_d;              // nearest palette index of every RGB cell, for ditherOrdered
+    cl_mem pyramid_d[PYRAMID_MAX + 1];  // coarse-to-fine mode: downsampled levels of the image, 0 unused
+    long pyramidCapacity[PYRAMID_MAX + 1];
+    cl_kernel batchKernel;              // mini-batch mode: assignBatch
+    cl_kernel batchUpdateKernel;        // mini-batch mode: updateMiniBatch
+
+    struct GPUSlot slots[2];
+
+    cl_mem centroids_d;
+    cl_mem clusterCount_d;
+    cl_mem maxShift_d;
+    cl_mem randIndexes_d;               // RAND_CHUNK iterations of K indexes
+    cl_mem state_d;                     // fused mode: groups done, iterations run, largest shift, converged
+    cl_mem clusterBounds_d[3];          // Hamerly bounds per centroid (drift, otherDrift, halfDist)
+    cl_mem imageOut_d;                  // output image built by gpuMapColors
+    cl_mem centers_d;                   // mini-batch mode: exact centroid positions (R, G, B floats)
+    cl_mem totals_d;                    // mini-batch mode: points seen by each centroid
+    size_t imageOutCapacity;
+
+    cl_long *clusterCount;              // (Rsum, Gsum, Bsum, pixelCount) for each cluster, 64-bit for large images
+    int *randIndexes;                   // two host halves, one may still be uploading while the other is filled
+};
+
+// Shared state of the pipeline stages
+struct Pipeline {
+    struct Job *jobs;
+    int numJobs;
+    struct Options *options;
+    struct GPUEngine *gpu;
+
+    int nextJob;                        // next image for the decoders
+    struct Queue decoded;               // decoders -> clustering
+    struct Queue clustered;             // clustering -> encoders
+
+    pthread_mutex_t printLock;          // also guards the totals below
+    int batch;
+    int done;
+    double totalPixels;
+    double decodeTime;
+    double clusterTime;
+    double encodeTime;
+};
 
 void printPlatformsInfo(cl_device_id *devices, cl_uint num_devices);
 void checkStatus(cl_int status, char *location);
-
-struct Color {
-   unsigned char R;
-   unsigned char G;
-   unsigned char B;
-};  
+double gpuInit(struct GPUEngine *gpu, struct KMeansParams *params, int weighted, struct GPUOptions *options);
+void gpuUpload(struct GPUEngine *gpu, int slot, unsigned char *points, int *weights, long numPoints, int zeroCopy);
+double gpuKMeans(struct GPUEngine *gpu, int slot, void *c, struct Color *centroids,
+                 struct KMeansParams *params, int *iterations);
+double gpuKMeansStreaming(struct GPUEngine *gpu, unsigned char *points, int *weights, long numPoints, long bandPoints,
+                          void *c, struct Color *centroids, struct KMeansParams *params, int *iterations,
+                          int pointsMapped, int cMapped);
+double gpuKMeansPyramid(struct GPUEngine *gpu, int s, void *c, struct Color *centroids,
+                        struct KMeansParams *params, int *iterations, int width, int height, int levels);
+double gpuDither(struct GPUEngine *gpu, int s, unsigned char *imageIn, const struct Color *centroids,
+                 int width, int height, int mode);
+double gpuMapColors(struct GPUEngine *gpu, int s, const struct Color *centroids, unsigned char *imageOut,
+                    int width, int height, int channels, int flip);
+void gpuRelease(struct GPUEngine *gpu);
+void *decodeWorker(void *arg);
+void *encodeWorker(void *arg);
+void clusterImages(struct Pipeline *pipeline);
+int readManifest(const char *manifestFile, struct Job **jobs);
+int listInputs(const char *input, const char *outputDir, struct Job **jobs);
 
 
 int main(int argc, char *argv[]) {    
@@ -32,12 +214,32 @@ int main(int argc, char *argv[]) {
     int I = 50;
     int showDevices = 0;
     int deviceID = 0;
+    int backend = BACKEND_GPU;
+    int init = INIT_RANDOM;
+    int colorSpace = COLOR_RGB;
+    int dither = DITHER_NONE;
+    unsigned int seed = time(NULL);
+    int compact = 0;
+    double tolerance = -1;
+    int assign = ASSIGN_BRUTE;
+    int fused = 0;
+    int treeReduce = 0;
+    int bandRows = 0;
+    int palette = 0;
+    int pngThreads = 0;
+    int rawWidth = 0, rawHeight = 0;
+    int indexOutput = 0;
+    int batchSize = 0;
+    int pyramidLevels = 0;
+    int poolSize = 2;
 
     char *inputFile = NULL;
     char *outputFile = "compressed.png";
+    char *manifestFile = NULL;
+    char *kernelFile = NULL;
 
     char flag;
-    while ((flag = getopt(argc, argv, "K:I:d:s")) != -1) {
+    while ((flag = getopt(argc, argv, "K:I:d:sb:S:ut:a:m:j:k:fr:B:pz:g:xi:M:P:c:D:")) != -1) {
         switch (flag) {
             case 'K':
                 K = atoi(optarg);
@@ -63,330 +265,2265 @@ int main(int argc, char *argv[]) {
             case 's':
                 showDevices = 1;
                 break;
+            case 'b':
+                if (strcmp(optarg, "gpu") == 0) {
+                    backend = BACKEND_GPU;
+                }
+                else if (strcmp(optarg, "cpu") == 0) {
+                    backend = BACKEND_CPU;
+                }
+                else {
+                    fprintf(stderr, "Option -b requires 'gpu' or 'cpu' as argument.\n");
+                    exit(1);
+                }
+                break;
+            case 'i':
+                if (strcmp(optarg, "random") == 0) {
+                    init = INIT_RANDOM;
+                }
+                else if (strcmp(optarg, "parallel") == 0) {
+                    init = INIT_PARALLEL;
+                }
+                else {
+                    fprintf(stderr, "Option -i requires 'random' or 'parallel' as argument.\n");
+                    exit(1);
+                }
+                break;
+            case 'c':
+                if (strcmp(optarg, "rgb") == 0) {
+                    colorSpace = COLOR_RGB;
+                }
+                else if (strcmp(optarg, "oklab") == 0) {
+                    colorSpace = COLOR_OKLAB;
+                }
+                else if (strcmp(optarg, "lab") == 0) {
+                    colorSpace = COLOR_LAB;
+                }
+                else {
+                    fprintf(stderr, "Option -c requires 'rgb', 'oklab' or 'lab' as argument.\n");
+                    exit(1);
+                }
+                break;
+            case 'D':
+                if (strcmp(optarg, "fs") == 0) {
+                    dither = DITHER_FS;
+                }
+                else if (strcmp(optarg, "bayer") == 0) {
+                    dither = DITHER_BAYER;
+                }
+                else if (strcmp(optarg, "noise") == 0) {
+                    dither = DITHER_NOISE;
+                }
+                else {
+                    fprintf(stderr, "Option -D requires 'fs', 'bayer' or 'noise' as argument.\n");
+                    exit(1);
+                }
+                break;
+            case 'S':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                compact = 1;
+                break;
+            case 't':
+                tolerance = atof(optarg);
+                if (tolerance < 0) {
+                    fprintf(stderr, "Option -%c requires a non-negative numeric argument.\n", optopt);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                if (strcmp(optarg, "brute") == 0) {
+                    assign = ASSIGN_BRUTE;
+                }
+                else if (strcmp(optarg, "hamerly") == 0) {
+                    assign = ASSIGN_HAMERLY;
+                }
+                else {
+                    fprintf(stderr, "Option -a requires 'brute' or 'hamerly' as argument.\n");
+                    exit(1);
+                }
+                break;
+            case 'f':
+                fused = 1;
+                break;
+            case 'r':
+                if (strcmp(optarg, "atomic") == 0) {
+                    treeReduce = 0;
+                }
+                else if (strcmp(optarg, "tree") == 0) {
+                    treeReduce = 1;
+                }
+                else {
+                    fprintf(stderr, "Option -r requires 'atomic' or 'tree' as argument.\n");
+                    exit(1);
+                }
+                break;
+            case 'B':
+                bandRows = atoi(optarg);
+                if (bandRows <= 0) {
+                    fprintf(stderr, "Option -%c requires a positive numeric argument.\n", optopt);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                pyramidLevels = atoi(optarg);
+                if (pyramidLevels <= 0 || pyramidLevels > PYRAMID_MAX) {
+                    fprintf(stderr, "Option -P requires a number of levels from 1 to %d.\n", PYRAMID_MAX);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                palette = 1;
+                break;
+            case 'z':
+                pngThreads = atoi(optarg);
+                if (pngThreads <= 0) {
+                    fprintf(stderr, "Option -%c requires a positive numeric argument.\n", optopt);
+                    exit(1);
+                }
+                break;
+            case 'g':
+                if (sscanf(optarg, "%dx%d", &rawWidth, &rawHeight) != 2 || rawWidth <= 0 || rawHeight <= 0) {
+                    fprintf(stderr, "Option -g requires the frame size as argument (WIDTHxHEIGHT).\n");
+                    exit(1);
+                }
+                break;
+            case 'x':
+                indexOutput = 1;
+                break;
+            case 'M':
+                batchSize = atoi(optarg);
+                if (batchSize <= 0) {
+                    fprintf(stderr, "Option -%c requires a positive numeric argument.\n", optopt);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                manifestFile = optarg;
+                break;
+            case 'k':
+                kernelFile = optarg;
+                break;
+            case 'j':
+                poolSize = atoi(optarg);
+                if (poolSize <= 0) {
+                    fprintf(stderr, "Option -%c requires a positive numeric argument.\n", optopt);
+                    exit(1);
+                }
+                break;
             default:
                 exit(1);
         }
     }
     
-    if (argc-optind == 1) {
-        inputFile = argv[optind];
-    } 
-    else if (argc-optind == 2) {
+    struct Job *jobs = NULL;
+    int numJobs = 0;
+    int batch = 1;
+
+    if (manifestFile && argc-optind == 0) {
+        numJobs = readManifest(manifestFile, &jobs);
+    }
+    else if (argc-optind == 1 || argc-optind == 2) {
         inputFile = argv[optind];
-        outputFile = argv[optind+1];
+        if (argc-optind == 2) {
+            outputFile = argv[optind+1];
+        }
+
+        // A directory or a glob pattern is a batch, output goes to a directory
+        struct stat st;
+        if ((stat(inputFile, &st) == 0 && S_ISDIR(st.st_mode)) || strpbrk(inputFile, "*?[")) {
+            numJobs = listInputs(inputFile, argc-optind == 2 ? outputFile : "compressed", &jobs);
+        }
+        else {
+            jobs = malloc(sizeof(struct Job));
+            jobs[0].inputFile = strdup(inputFile);
+            jobs[0].outputFile = strdup(outputFile);
+            numJobs = 1;
+            batch = 0;
+        }
     }
     else {
-        fprintf(stderr, "Usage: ./gpu input_file output_file [-K clusters] [-I iterations]\n");
+        fprintf(stderr, "Usage: ./gpu input_file output_file [-K clusters] [-I iterations] [-b gpu|cpu] [-i random|parallel] [-c rgb|oklab|lab] [-D fs|bayer|noise] [-S seed] [-u] [-t tolerance] [-a brute|hamerly] [-f] [-r atomic|tree] [-B band_rows] [-M batch_size] [-P levels] [-p] [-z threads] [-g WxH] [-x] [-j threads] [-k kernel_file]\n");
+        fprintf(stderr, "       ./gpu input_dir|'pattern' [output_dir] [options]\n");
+        fprintf(stderr, "       ./gpu -m manifest_file [options]\n");
         exit(1);
     }
 
+    if (numJobs == 0) {
+        fprintf(stderr, "No input images.\n");
+        exit(1);
+    }
+
+    if (fused && assign == ASSIGN_HAMERLY) {
+        fprintf(stderr, "Option -f only supports brute force assignment (-a brute).\n");
+        exit(1);
+    }
+    if (fused && treeReduce) {
+        fprintf(stderr, "Option -f only supports atomic reduction (-r atomic).\n");
+        exit(1);
+    }
+    if (palette && K > 256) {
+        fprintf(stderr, "Option -p supports at most 256 clusters.\n");
+        exit(1);
+    }
+    if (bandRows && (fused || assign == ASSIGN_HAMERLY)) {
+        fprintf(stderr, "Option -B does not support -f or -a hamerly.\n");
+        exit(1);
+    }
+    if (batchSize && (fused || assign == ASSIGN_HAMERLY || bandRows || tolerance >= 0)) {
+        fprintf(stderr, "Option -M does not support -f, -a hamerly, -B or -t.\n");
+        exit(1);
+    }
+    if (pyramidLevels && (compact || bandRows || batchSize)) {
+        fprintf(stderr, "Option -P does not support -u, -B or -M.\n");
+        exit(1);
+    }
+
+    struct Options options = {
+        .params = { .K = K, .I = I, .tolerance = tolerance, .assign = assign, .indexSize = indexSize(K),
+                    .batchSize = batchSize },
+        .backend = backend,
+        .init = init,
+        .colorSpace = colorSpace,
+        .dither = dither,
+        .compact = compact,
+        .seed = seed,
+        .bandRows = bandRows,
+        .pyramidLevels = pyramidLevels,
+        .palette = palette,
+        .pngThreads = pngThreads,
+        .rawWidth = rawWidth,
+        .rawHeight = rawHeight,
+        .indexOutput = indexOutput
+    };
 
-    srand(time(NULL));   
-    cl_int status;
 
     /*************************************/
-    /*      LOAD IMAGE                    */    
+    /*   SET UP OPENCL (ONCE PER RUN)    */    
     /*************************************/
 
-	FIBITMAP *imageBitmap = FreeImage_Load(FIF_PNG, inputFile, 0);
-    // Convert to 32-bit image
-    FIBITMAP *imageBitmap32 = FreeImage_ConvertTo32Bits(imageBitmap);
-	
-    // Get image dimensions
-    int width = FreeImage_GetWidth(imageBitmap32);
-	int height = FreeImage_GetHeight(imageBitmap32);
-	int pitch = FreeImage_GetPitch(imageBitmap32);
+    struct GPUEngine gpu;
+    if (backend == BACKEND_GPU) {
+        struct GPUOptions gpuOptions = {
+            .deviceID = deviceID,
+            .showDevices = showDevices,
+            .fused = fused,
+            .treeReduce = treeReduce,
+            .kernelFile = kernelFile
+        };
+        double setupTime = gpuInit(&gpu, &options.params, compact, &gpuOptions);
+        printf("OpenCL setup: %.3fs\n", setupTime);
+    }
+
 
     /*************************************/
-    /*      ALLOCATE MEMORY ON HOST      */    
+    /*   COMPRESS IMAGES                 */    
     /*************************************/
-	
-    // Prepare room for a raw data copy of the image
-    unsigned char *imageIn= (unsigned char *)malloc(height * pitch * sizeof(unsigned char));
-    // Extract raw data from the image
-	FreeImage_ConvertToRawBits(imageIn, imageBitmap32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-    // Free source image data
-	FreeImage_Unload(imageBitmap32);
-	FreeImage_Unload(imageBitmap);
 
+    // Decoders, clustering (this thread) and encoders work on different images at the same time
+    struct Pipeline pipeline = {
+        .jobs = jobs,
+        .numJobs = numJobs,
+        .options = &options,
+        .gpu = &gpu,
+        .batch = batch
+    };
+    queueInit(&pipeline.decoded, QUEUE_DEPTH, numJobs);
+    queueInit(&pipeline.clustered, QUEUE_DEPTH, numJobs);
+    pthread_mutex_init(&pipeline.printLock, NULL);
+
+    double batchTime = omp_get_wtime();
+
+    pthread_t decoders[poolSize];
+    pthread_t encoders[poolSize];
+    for (int t = 0; t < poolSize; t++) {
+        pthread_create(&decoders[t], NULL, decodeWorker, &pipeline);
+        pthread_create(&encoders[t], NULL, encodeWorker, &pipeline);
+    }
 
-    int *c = malloc(width * height * sizeof(int));              // cluster number for each pixel
-    struct Color *centroids = malloc(K * sizeof(struct Color)); // centroids (B, G, R)
-    int *clusterCount = calloc(K * 4, sizeof(int));            // (Rsum, Gsum, Bsum, pixelCount) for each cluster
-    int *randIndexes = malloc(K * sizeof(int));                
+    clusterImages(&pipeline);
 
+    for (int t = 0; t < poolSize; t++) {
+        pthread_join(decoders[t], NULL);
+        pthread_join(encoders[t], NULL);
+    }
+    batchTime = omp_get_wtime() - batchTime;
 
-    // Initialize centroids - Randomly assign pixels 
-    for(int i = 0; i < K; i++) {
-        int y = rand() % (height - 2);
-        int x = rand() % (width - 2);
-        centroids[i].R = imageIn[(y*width+x)*4+2];
-        centroids[i].G = imageIn[(y*width+x)*4+1];
-        centroids[i].B = imageIn[(y*width+x)*4];
+    if (batch) {
+        printf("\nImages: %d of %d in %.3fs\n", pipeline.done, numJobs, batchTime);
+        printf("Throughput: %.2f images/s, %.1f MP/s\n", pipeline.done / batchTime, pipeline.totalPixels / batchTime / 1e6);
+        printf("Stage busy time: decode %.3fs (%d threads), cluster %.3fs, encode %.3fs (%d threads)\n",
+               pipeline.decodeTime, poolSize, pipeline.clusterTime, pipeline.encodeTime, poolSize);
     }
 
 
     /*************************************/
-    /*      DELITEV DELA                 */    
+    /*   CLEANUP                         */    
     /*************************************/
 
-    // Kernel 1 
-    size_t localItemSize = 256;
-    size_t numGroups = (((height * width) - 1) / localItemSize + 1);
-    size_t globalItemSize = numGroups * localItemSize;
-
-    // Kernel 2
-    size_t globalItemSize2 = K; 
-    size_t localItemSize2 = K; 
+    if (backend == BACKEND_GPU) {
+        gpuRelease(&gpu);
+    }
+    queueFree(&pipeline.decoded);
+    queueFree(&pipeline.clustered);
+    pthread_mutex_destroy(&pipeline.printLock);
+    for (int j = 0; j < numJobs; j++) {
+        free(jobs[j].inputFile);
+        free(jobs[j].outputFile);
+    }
+    free(jobs);
 
+    return pipeline.done == numJobs ? 0 : 1;
+}
 
-    /*************************************/
-    /*      READ KERNEL SOURCE           */    
-    /*************************************/
 
-    FILE *fp;
-    char *sourceStr;
-    size_t sourceSize;
+/*
+    Full color output images are built on the device unless the host needs
+    the per pixel assignments. Ordered dithering runs on the device too, it
+    needs the sRGB image there. Streamed images are never whole on the device.
+*/
 
-    fp = fopen("kernels.cl", "r");
-    if (!fp) {
-		fprintf(stderr, "Error opening kernel.cl\n");
-        exit(1);
-    }
-    sourceStr = (char*)malloc(MAX_SOURCE_SIZE);
-    sourceSize = fread(sourceStr, 1, MAX_SOURCE_SIZE, fp);
-	sourceStr[sourceSize] = '\0';
-    fclose(fp);
+static int mapsOnDevice(struct Options *options) {
+    int hostDither = options->dither == DITHER_FS || (options->dither && options->colorSpace);
+    return options->backend == BACKEND_GPU && options->bandRows <= 0 && !options->compact && !options->palette
+           && !options->indexOutput && !hostDither;
+}
 
-    
-    /*************************************/
-    /*   DISCOVER AVAILABLE PLATFORMS    */    
-    /*************************************/
- 
-    cl_platform_id	platforms[10];
-    cl_uint	numOfPlatforms;
-	char *buf;
-	size_t bufLen;
-	status = clGetPlatformIDs(10, platforms, &numOfPlatforms);
-    checkStatus(status, "clGetPlatformIDs");
 
-	
-	cl_device_id devices[10];
-	cl_uint	numOfDevices;
-	status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 10,	
-						 devices, &numOfDevices);	
-    checkStatus(status, "clGetDeviceIDs");
+/*
+    Decode stage: loads images and extracts their points to cluster
+*/
 
+void *decodeWorker(void *arg) {
+    struct Pipeline *pipeline = arg;
+    struct Options *options = pipeline->options;
 
-    if (showDevices) {
-        printPlatformsInfo(devices, numOfDevices);
-    }
-        
+    while (1) {
+        int j = __atomic_fetch_add(&pipeline->nextJob, 1, __ATOMIC_RELAXED);
+        if (j >= pipeline->numJobs) {
+            break;
+        }
 
-    /*************************************/
-    /*   CREATE A CONTEXT                */    
-    /*************************************/
+        struct Image *image = calloc(1, sizeof(struct Image));
+        image->index = j;
+        image->startTime = omp_get_wtime();
 
-    cl_context context = clCreateContext(NULL, 1, &devices[deviceID], NULL, NULL, &status);
-    checkStatus(status, "clCreateContext");
 
+        /*************************************/
+        /*      LOAD IMAGE                    */    
+        /*************************************/
 
-    /*************************************/
-    /*   CREATE A COMMAND QUEUE          */    
-    /*************************************/
+        int width = options->rawWidth, height = options->rawHeight, pitch = 0;
+        if (isRawFile(pipeline->jobs[j].inputFile)) {
+            // Raw frames and PPM/PAM are mapped instead of decoded
+            image->imageIn = rawLoad(pipeline->jobs[j].inputFile, &width, &height, &image->mapped);
+            image->rawInput = 1;
+            pitch = width * 4;
+        }
+        else if (options->pngThreads) {
+            // Falls back to FreeImage for PNGs the zlib codec does not handle
+            image->imageIn = pngLoad(pipeline->jobs[j].inputFile, &width, &height, options->pngThreads);
+            pitch = width * 4;
+        }
+        if (!image->imageIn && !image->rawInput) {
+            FIBITMAP *imageBitmap = FreeImage_Load(FIF_PNG, pipeline->jobs[j].inputFile, 0);
+            if (!imageBitmap) {
+                queuePut(&pipeline->decoded, j, image);
+                continue;
+            }
+            // Convert to 32-bit image, 32-bit PNGs are used as loaded
+            if (FreeImage_GetBPP(imageBitmap) != 32) {
+                FIBITMAP *imageBitmap32 = FreeImage_ConvertTo32Bits(imageBitmap);
+                FreeImage_Unload(imageBitmap);
+                imageBitmap = imageBitmap32;
+            }
+
+            // Get image dimensions
+            width = FreeImage_GetWidth(imageBitmap);
+            height = FreeImage_GetHeight(imageBitmap);
+            pitch = FreeImage_GetPitch(imageBitmap);
+
+            // Work on the bitmap's own pixels, flipped in place to top-down rows instead of copied out
+            FreeImage_FlipVertical(imageBitmap);
+            image->bitmap = imageBitmap;
+            image->imageIn = FreeImage_GetBits(imageBitmap);
+        }
+        if (!image->imageIn) {
+            queuePut(&pipeline->decoded, j, image);
+            continue;
+        }
+        image->width = width;
+        image->height = height;
+        image->pitch = pitch;
+        image->decodeTime = omp_get_wtime() - image->startTime;
+
+        // The CPU engine needs room for int indexes while it runs, output built on the device needs no indexes
+        int indexSize = options->params.indexSize;
+        int workSize = options->backend == BACKEND_CPU ? (int) sizeof(int) : indexSize;
+        size_t cSize = (size_t) width * height * (options->compact ? indexSize : workSize);
+        if (options->indexOutput) {
+            // Index maps are clustered and read back straight into the output file, a buffer only if it cannot be mapped
+            image->c = rawMapIndexes(pipeline->jobs[j].outputFile, cSize);
+            image->cMapped = image->c ? cSize : 0;
+        }
+        if (!image->c && !mapsOnDevice(options)) {
+            image->c = malloc(cSize);
+        }
+        image->centroids = malloc(options->params.K * sizeof(struct Color));
+
+        // Cluster unique colors weighted by pixel count instead of all pixels
+        image->points = image->imageIn;
+        image->weights = NULL;
+        image->numPoints = (long) width * height;
+        image->pointClusters = image->c;
+
+        if (options->compact) {
+            double compactTime = omp_get_wtime();
+            buildColorTable(&image->colorTable, image->imageIn, (long) width * height);
+            image->points = image->colorTable.colors;
+            image->weights = image->colorTable.weights;
+            image->numPoints = image->colorTable.numColors;
+            image->pointClusters = malloc((size_t) image->numPoints * workSize);
+            image->compactTime = omp_get_wtime() - compactTime;
+        }
 
-    cl_command_queue commandQueue = clCreateCommandQueue(context, devices[deviceID], 0, &status);
-    checkStatus(status, "clCreateCommandQueue");
+        // Cluster in a perceptual color space, the centroids are converted back after clustering
+        if (options->colorSpace && options->dither && !options->compact) {
+            // Dithering reads the sRGB pixels after clustering, convert a copy
+            image->points = malloc((size_t) image->numPoints * 4);
+            memcpy(image->points, image->imageIn, (size_t) image->numPoints * 4);
+        }
+        if (options->colorSpace) {
+            pointsToColorSpace(image->points, image->numPoints, options->colorSpace);
+        }
 
+        double decodeTime = omp_get_wtime() - image->startTime;
+        pthread_mutex_lock(&pipeline->printLock);
+        pipeline->decodeTime += decodeTime;
+        pthread_mutex_unlock(&pipeline->printLock);
 
+        queuePut(&pipeline->decoded, j, image);
+    }
 
-    /*************************************/
-    /*   CREATE DEVICE BUFFERS           */    
-    /*************************************/
+    return NULL;
+}
 
-    cl_mem imageIn_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-									  height * pitch * sizeof(unsigned char), imageIn, &status);
-    checkStatus(status, "clCreateBuffer");
 
+/*
+    Cluster stage: runs K-means on the images in batch order, so results do
+    not depend on thread timing. On the GPU the next image is uploaded on the
+    second command queue while the current one is clustered.
+*/
 
-    cl_mem c_d = clCreateBuffer(context, CL_MEM_READ_WRITE, width * height * sizeof(int), NULL, &status);
-    checkStatus(status, "clCreateBuffer");
+void clusterImages(struct Pipeline *pipeline) {
+    struct Options *options = pipeline->options;
+    struct GPUEngine *gpu = pipeline->gpu;
+    int K = options->params.K;
+    int gpuBackend = options->backend == BACKEND_GPU;
 
-    cl_mem centroids_d = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, K * sizeof(struct Color), centroids, &status);
-    checkStatus(status, "clCreateBuffer");
-        
-    cl_mem clusterCount_d = clCreateBuffer(context, CL_MEM_READ_WRITE, 4 * K * sizeof(int), NULL, &status);
-    checkStatus(status, "clCreateBuffer");
+    // Streamed images are uploaded band by band while they are clustered
+    int streaming = gpuBackend && options->bandRows > 0;
+    int mapOnDevice = mapsOnDevice(options);
 
+    struct Image *image = queueGet(&pipeline->decoded);
+    int uploaded = 0;
 
+    while (image) {
+        int slot = image->index % 2;
+        if (gpuBackend && !streaming && image->imageIn && !uploaded) {
+            gpuUpload(gpu, slot, image->points, image->weights, image->numPoints, image->rawInput && image->points == image->imageIn);
+        }
 
-    /*************************************/
-    /*   CREATE PROGRAM OBJECT           */    
-    /*************************************/
+        // Start uploading the next image if it is already decoded
+        struct Image *next = queueTryGet(&pipeline->decoded);
+        uploaded = 0;
+        if (gpuBackend && !streaming && next && next->imageIn) {
+            gpuUpload(gpu, next->index % 2, next->points, next->weights, next->numPoints, next->rawInput && next->points == next->imageIn);
+            uploaded = 1;
+        }
 
-    cl_program program = clCreateProgramWithSource(context,	1, (const char **)&sourceStr, NULL, &status);												
-    checkStatus(status, "clCreateProgramWithSource");
+        if (image->imageIn) {
+            double clusterTime = omp_get_wtime();
+            unsigned char *imageIn = image->imageIn;
+            int width = image->width;
+            int height = image->height;
+
+            // Every image has its own seed, so its output does not depend on its position in the batch
+            srand(options->seed + image->index);
+
+            if (options->init == INIT_PARALLEL) {
+                double seedTime = omp_get_wtime();
+                seedCentroids(image->points, image->weights, image->numPoints, image->centroids, K, rand());
+                image->seedTime = omp_get_wtime() - seedTime;
+            }
+            else {
+                // Initialize centroids - Randomly assign pixels
+                int pitch = image->pitch;
+                for(int i = 0; i < K; i++) {
+                    int y = rand() % (height - 2);
+                    int x = rand() % (width - 2);
+                    image->centroids[i].R = imageIn[(long) y*pitch+x*4+2];
+                    image->centroids[i].G = imageIn[(long) y*pitch+x*4+1];
+                    image->centroids[i].B = imageIn[(long) y*pitch+x*4];
+                }
+                // Compacted points are converted, the image itself stays in sRGB for the final mapping
+                if (options->colorSpace && image->points != imageIn) {
+                    colorsToColorSpace(image->centroids, K, options->colorSpace);
+                }
+            }
+
+            if (streaming) {
+                // Unconverted .bgra mappings and -x index mappings are only held a band at a time
+                int pointsMapped = image->mapped && image->points == imageIn && !options->colorSpace;
+                int cMapped = image->cMapped && image->pointClusters == image->c;
+                image->elapsed = gpuKMeansStreaming(gpu, image->points, image->weights, image->numPoints, (long) options->bandRows * width,
+                                                    image->pointClusters, image->centroids, &options->params, &image->iterations,
+                                                    pointsMapped, cMapped);
+            }
+            else if (gpuBackend && options->pyramidLevels) {
+                // With the output image built on the device, the assignments are never read back
+                image->elapsed = gpuKMeansPyramid(gpu, slot, mapOnDevice ? NULL : image->pointClusters, image->centroids,
+                                                  &options->params, &image->iterations, width, height, options->pyramidLevels);
+            }
+            else if (gpuBackend) {
+                image->elapsed = gpuKMeans(gpu, slot, mapOnDevice ? NULL : image->pointClusters, image->centroids,
+                                           &options->params, &image->iterations);
+            }
+            else if (options->pyramidLevels) {
+                image->elapsed = cpuKMeansPyramid(image->points, width, height, options->pyramidLevels, image->pointClusters,
+                                                  image->centroids, &options->params, &image->iterations);
+            }
+            else {
+                image->elapsed = cpuKMeans(image->points, image->weights, image->numPoints, image->pointClusters,
+                                           image->centroids, &options->params, &image->iterations);
+            }
+
+            if (options->colorSpace) {
+                colorsToSRGB(image->centroids, K, options->colorSpace);
+            }
+
+            if (mapOnDevice) {
+                if (options->dither) {
+                    image->ditherTime = gpuDither(gpu, slot, imageIn, image->centroids, width, height, options->dither);
+                }
+                if (options->pngThreads) {
+                    image->imageOut = malloc((size_t) width * height * 3);
+                    image->encodeTime = gpuMapColors(gpu, slot, image->centroids, image->imageOut, width, height, 3, 0);
+                }
+                else {
+                    image->outBitmap = FreeImage_Allocate(width, height, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+                    image->encodeTime = gpuMapColors(gpu, slot, image->centroids, FreeImage_GetBits(image->outBitmap), width, height, 4, 1);
+                }
+            }
 
-    /*************************************/
-    /*   BUILD PROGRAM                   */    
-    /*************************************/
+            pthread_mutex_lock(&pipeline->printLock);
+            pipeline->clusterTime += omp_get_wtime() - clusterTime;
+            pthread_mutex_unlock(&pipeline->printLock);
+        }
 
-    // Build program
-    char buildArgs[64];
-    sprintf(buildArgs, "-DK=%d", K);
-    status = clBuildProgram(program, 1, &devices[deviceID], buildArgs, NULL, NULL);
+        queuePut(&pipeline->clustered, image->index, image);
 
-    // Log kernel compilation errors
-    if (status == CL_BUILD_PROGRAM_FAILURE) {
-        size_t logSize;
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
-        char *log = (char *) malloc(logSize);
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, logSize, log, NULL);
-        printf("%s\n", log);
+        image = next ? next : queueGet(&pipeline->decoded);
     }
+}
 
-  
-    /*************************************/
-    /*   COMPILE KERNELS                 */    
-    /*************************************/
 
-    cl_kernel kernel = clCreateKernel(program, "assignToCluster", &status);
-    checkStatus(status, "clCreateKernel");
+/*
+    Encode stage: builds and saves the output image, prints its report
+*/
 
-    cl_kernel kernel2 = clCreateKernel(program, "updateCentroids", &status);
-    checkStatus(status, "clCreateKernel");
+void *encodeWorker(void *arg) {
+    struct Pipeline *pipeline = arg;
+    struct Options *options = pipeline->options;
+    struct Image *image;
 
+    while ((image = queueGet(&pipeline->clustered))) {
+        const char *inputFile = pipeline->jobs[image->index].inputFile;
+        const char *outputFile = pipeline->jobs[image->index].outputFile;
 
-    /*************************************/
-    /*   SET KERNEL ARGUMENTS            */    
-    /*************************************/
- 
-    // kernel1
-    status = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&imageIn_d);
-    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&c_d);
-    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&centroids_d);
-    status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&clusterCount_d);
-    status |= clSetKernelArg(kernel, 4, sizeof(cl_int), (void *)&height);
-    status |= clSetKernelArg(kernel, 5, sizeof(cl_int), (void *)&width);
-    checkStatus(status, "clSetKernelArg");
+        if (!image->imageIn) {
+            pthread_mutex_lock(&pipeline->printLock);
+            fprintf(stderr, "Error loading %s\n", inputFile);
+            pthread_mutex_unlock(&pipeline->printLock);
+            free(image);
+            continue;
+        }
 
-    // kernel2
-    status = clSetKernelArg(kernel2, 0, sizeof(cl_mem), (void *)&centroids_d);
-    status |= clSetKernelArg(kernel2, 2, sizeof(cl_mem), (void *)&c_d);
-    status |= clSetKernelArg(kernel2, 4, sizeof(cl_mem), (void *)&imageIn_d);
-    checkStatus(status, "clSetKernelArg");
+        double encodeTime = omp_get_wtime();
+        int width = image->width;
+        int height = image->height;
+        void *c = image->c;
+        int indexSize = options->params.indexSize;
+        struct Color *centroids = image->centroids;
+
+        if (options->compact) {
+            double mapTime = omp_get_wtime();
+            mapColorTable(&image->colorTable, image->imageIn, (long) width * height, image->pointClusters, c, indexSize);
+            image->compactTime += omp_get_wtime() - mapTime;
+            free(image->pointClusters);
+            freeColorTable(&image->colorTable);
+        }
 
+        // Remap the pixels to the palette with dithering, unless it was done on the device
+        if (options->dither && !image->outBitmap && !image->imageOut) {
+            image->ditherTime = ditherImage(image->imageIn, width, height, centroids, options->params.K,
+                                            c, indexSize, options->dither);
+        }
+        if (!options->compact && image->points != image->imageIn) {
+            free(image->points);
+        }
 
-    double startTime = omp_get_wtime();
+        // The input is not needed anymore, release it before the output image is built
+        if (image->bitmap) {
+            FreeImage_Unload(image->bitmap);
+        }
+        else if (image->rawInput) {
+            rawUnload(image->imageIn, image->mapped);
+        }
+        else {
+            free(image->imageIn);
+        }
 
 
-    /*************************************/
-    /*   RUN                             */    
-    /*************************************/
+        /*************************************/
+        /*   CREATE OUTPUT IMAGE             */    
+        /*************************************/
 
-    for (int i = 0; i < I; i++) {    
+        double saveTime = omp_get_wtime();
+        int saved = 1;
+        if (image->outBitmap) {
+            saved = FreeImage_Save(FIF_PNG, image->outBitmap, outputFile, 0);
+            FreeImage_Unload(image->outBitmap);
+        }
+        else if (image->imageOut) {
+            saved = pngSave(outputFile, image->imageOut, width, height, 3, NULL, 0, options->pngThreads);
+            free(image->imageOut);
+        }
+        else if (options->indexOutput) {
+            saved = rawSaveIndexes(outputFile, c, image->cMapped, (long) width * height, indexSize, centroids, options->params.K);
+        }
+        else if (options->pngThreads && options->palette) {
+            saved = pngSave(outputFile, c, width, height, 1, centroids, options->params.K, options->pngThreads);
+        }
+        else if (options->pngThreads) {
+            unsigned char *imageOut = malloc((size_t) width * height * 3);
+            #pragma omp parallel for schedule(static) num_threads(options->pngThreads)
+            for (long i = 0; i < (long) width * height; i++) {
+                int cluster = getIndex(c, indexSize, i);
+                imageOut[i*3] = centroids[cluster].R;
+                imageOut[i*3+1] = centroids[cluster].G;
+                imageOut[i*3+2] = centroids[cluster].B;
+            }
+            saved = pngSave(outputFile, imageOut, width, height, 3, NULL, 0, options->pngThreads);
+            free(imageOut);
+        }
+        else {
+            FIBITMAP *dst;
+            if (options->palette) {
+                // 8-bit image with a K entry palette, the (1 byte) indexes are the pixels
+                dst = FreeImage_Allocate(width, height, 8, 0, 0, 0);
+                RGBQUAD *palette = FreeImage_GetPalette(dst);
+                for (int j = 0; j < options->params.K; j++) {
+                    palette[j].rgbRed = centroids[j].R;
+                    palette[j].rgbGreen = centroids[j].G;
+                    palette[j].rgbBlue = centroids[j].B;
+                    palette[j].rgbReserved = 0;
+                }
+                for (int y = 0; y < height; y++) {
+                    memcpy(FreeImage_GetScanLine(dst, height - 1 - y), (unsigned char *) c + (size_t) y * width, width);
+                }
+            }
+            else {
+                // Colors go straight into the bitmap's (bottom-up) scanlines
+                dst = FreeImage_Allocate(width, height, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+                for (int y = 0; y < height; y++) {
+                    unsigned char *imageOut = FreeImage_GetScanLine(dst, height - 1 - y);
+                    for (int x = 0; x < width; x++) {
+                        int cluster = getIndex(c, indexSize, (long) y * width + x);
+                        imageOut[x*4+3] = 255;
+                        imageOut[x*4+2] = centroids[cluster].R;
+                        imageOut[x*4+1] = centroids[cluster].G;
+                        imageOut[x*4] = centroids[cluster].B;
+                    }
+                }
+            }
+            saved = FreeImage_Save(FIF_PNG, dst, outputFile, 0);
+            FreeImage_Unload(dst);
+        }
+        image->encodeTime += omp_get_wtime() - saveTime;
+
+        if (!saved) {
+            pthread_mutex_lock(&pipeline->printLock);
+            fprintf(stderr, "Failed to save %s\n", outputFile);
+            pthread_mutex_unlock(&pipeline->printLock);
+            if (!image->cMapped) {
+                free(c);
+            }
+            free(centroids);
+            free(image);
+            continue;
+        }
 
-        // Reset clusterCount
-        clusterCount_d = clCreateBuffer(context, CL_MEM_READ_WRITE, K * 4 * sizeof(int), NULL, &status);
-        checkStatus(status, "clCreateBuffer");
-        status = clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&clusterCount_d);
-        checkStatus(status, "clSetKernelArg");
-        status = clSetKernelArg(kernel2, 1, sizeof(cl_mem), (void *)&clusterCount_d);
-        checkStatus(status, "clSetKernelArg");
 
-        status = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL,						
-                                    &globalItemSize, &localItemSize, 0, NULL, NULL);	
-        checkStatus(status, "clEnqueueNDRangeKernel 1");
+        /*************************************/
+        /*  CALCULATE FILE SIZE REDUCTION   */    
+        /*************************************/
 
-        
-        // // Generate sequence of random pixel indexes (for fixing empty clusters)
-        for (int j = 0; j < K; j++) {
-            randIndexes[j] = rand() % (width * height - 2);
-        }
-        cl_mem randIndexes_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-									  K * sizeof(int), randIndexes, &status);
-        checkStatus(status, "clCreateBuffer");
-        status = clSetKernelArg(kernel2, 3, sizeof(cl_mem), (void *)&randIndexes_d);
-        checkStatus(status, "clSetKernelArg");                    
+        struct stat st;
+        stat(inputFile, &st);
+        int inSize =  (int) (st.st_size / 1024); 
+        stat(outputFile, &st);
+        int outSize =  (int) (st.st_size / 1024);     
 
+        double now = omp_get_wtime();
+        double imageTime = now - image->startTime;
 
-        status = clEnqueueNDRangeKernel(commandQueue, kernel2, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL, NULL);	
-        checkStatus(status, "clEnqueueNDRangeKernel kernel 2");
-    }
+        pthread_mutex_lock(&pipeline->printLock);
+        pipeline->encodeTime += now - encodeTime;
+        pipeline->totalPixels += (double) width * height;
+        pipeline->done++;
 
-    /*************************************/
-    /*   READ RESULTS BACK TO HOST       */    
-    /*************************************/
-																	
-    // Read result from device
-    status = clEnqueueReadBuffer(commandQueue, c_d, CL_TRUE, 0, width * height * sizeof(int), c, 0, NULL, NULL);				
-    checkStatus(status, "clEnqueueReadBuffer");
+        if (pipeline->batch) {
+            printf("\n[%d/%d]\n", image->index + 1, pipeline->numJobs);
+        }
+        printf("Input file: %s\n", inputFile);
+        printf("Output file: %s\n", outputFile);
+        if (options->backend == BACKEND_CPU) {
+            printf("Backend: cpu (%d threads, %s)\n", omp_get_max_threads(), cpuSimdName());
+        }
+        else {
+            printf("Backend: gpu%s\n", pipeline->gpu->fused ? " (fused)" : pipeline->gpu->treeReduce ? " (tree reduction)" : "");
+        }
+        printf("I: %d K: %d\n", options->params.I, options->params.K);
+        if (options->params.tolerance >= 0) {
+            printf("Iterations run: %d (tolerance %g)\n", image->iterations, options->params.tolerance);
+        }
+        if (options->compact) {
+            printf("Unique colors: %ld (%.1fx fewer points)\n", image->numPoints, (double) width * height / image->numPoints);
+            printf("Compaction time: %.3fs\n", image->compactTime);
+        }
+        if (options->init == INIT_PARALLEL) {
+            printf("Seeding time: %.3fs\n", image->seedTime);
+        }
+        if (options->dither) {
+            printf("Dither time: %.3fs\n", image->ditherTime);
+        }
+        printf("Time: %.3fs\n", image->elapsed);
+        printf("Decode time: %.3fs\n", image->decodeTime);
+        printf("Encode time: %.3fs\n", image->encodeTime);
+        printf("File size reduction: %.2f%\n", 100 *  (1 - (double) outSize  / inSize));
+        if (pipeline->batch) {
+            printf("Throughput: %.1f MP/s (%.3fs total)\n", (double) width * height / imageTime / 1e6, imageTime);
+        }
+        pthread_mutex_unlock(&pipeline->printLock);
 
-    status = clEnqueueReadBuffer(commandQueue, centroids_d, CL_TRUE, 0, K * sizeof(struct Color), centroids, 0, NULL, NULL);				
-    checkStatus(status, "clEnqueueReadBuffer");
 
-    status = clEnqueueReadBuffer(commandQueue, clusterCount_d, CL_TRUE, 0, K * 4 * sizeof(int), clusterCount, 0, NULL, NULL);				
-    checkStatus(status, "clEnqueueReadBuffer");
+        /*************************************/
+        /*   CLEANUP                         */    
+        /*************************************/
 
+        // rawSaveIndexes has unmapped a mapped c
+        if (!image->cMapped) {
+            free(c);
+        }
+        free(centroids);
+        free(image);
+    }
 
-    /*************************************/
-    /*   CREATE OUTPUT IMAGE             */    
-    /*************************************/
+    return NULL;
+}
 
-    unsigned char *imageOut = (unsigned char *) malloc(height * pitch * sizeof(unsigned char));
-    for (int i = 0; i < width * height; i++) {
-        int cluster = c[i];
-        imageOut[i*4+3] = 255; 
-        imageOut[i*4+2] = centroids[cluster].R; 
-        imageOut[i*4+1] = centroids[cluster].G; 
-        imageOut[i*4] = centroids[cluster].B; 
-    }
 
-    printf("Input file: %s\n", inputFile);
-    printf("Output file: %s\n", outputFile);
-    printf("I: %d K: %d\n", I, K);
-    printf("Time: %.3fs\n", omp_get_wtime() - startTime);
 
 
-    // Save image     
-    FIBITMAP *dst = FreeImage_ConvertFromRawBits(imageOut, width, height, pitch,
-		32, 0xFF, 0xFF, 0xFF, TRUE);
-	FreeImage_Save(FIF_PNG, dst, outputFile, 0);
 
 
-    /*************************************/
-    /*  CALCULATE FILE SIZE REDUCTION   */    
-    /*************************************/
+/*
+    Reads a batch manifest, one "input_file output_file" pair per line.
+    Empty lines and lines starting with # are skipped.
+*/
 
-    struct stat st;
-    stat(inputFile, &st);
-    int inSize =  (int) (st.st_size / 1024); 
-    stat(outputFile, &st);
-    int outSize =  (int) (st.st_size / 1024);     
-    printf("File size reduction: %.2f%\n", 100 *  (1 - (double) outSize  / inSize));
+int readManifest(const char *manifestFile, struct Job **jobs) {
+    FILE *fp = fopen(manifestFile, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening %s\n", manifestFile);
+        exit(1);
+    }
 
+    int numJobs = 0;
+    int size = 16;
+    *jobs = malloc(size * sizeof(struct Job));
+
+    char line[2 * MAX_PATH];
+    char input[MAX_PATH], output[MAX_PATH];
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#') {
+            continue;
+        }
+        int n = sscanf(line, "%4095s %4095s", input, output);
+        if (n <= 0) {
+            continue;
+        }
+        if (n == 1) {
+            fprintf(stderr, "Manifest line without output file: %s", line);
+            exit(1);
+        }
+        if (numJobs == size) {
+            size *= 2;
+            *jobs = realloc(*jobs, size * sizeof(struct Job));
+        }
+        (*jobs)[numJobs].inputFile = strdup(input);
+        (*jobs)[numJobs].outputFile = strdup(output);
+        numJobs++;
+    }
+    fclose(fp);
+
+    return numJobs;
+}
+
+
+/*
+    Lists all PNG files in a directory, or all files matching a glob pattern.
+    Outputs get the same file name in outputDir, which is created if needed.
+*/
+
+int listInputs(const char *input, const char *outputDir, struct Job **jobs) {
+    glob_t matches;
+    char pattern[MAX_PATH];
+
+    struct stat st;
+    if (stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+        snprintf(pattern, sizeof(pattern), "%s/*.png", input);
+    }
+    else {
+        snprintf(pattern, sizeof(pattern), "%s", input);
+    }
+
+    if (glob(pattern, 0, NULL, &matches) != 0) {
+        return 0;
+    }
+    mkdir(outputDir, 0755);
+
+    *jobs = malloc(matches.gl_pathc * sizeof(struct Job));
+    for (size_t j = 0; j < matches.gl_pathc; j++) {
+        char *path = strdup(matches.gl_pathv[j]);
+        char output[MAX_PATH];
+        snprintf(output, sizeof(output), "%s/%s", outputDir, basename(path));
+        free(path);
+
+        (*jobs)[j].inputFile = strdup(matches.gl_pathv[j]);
+        (*jobs)[j].outputFile = strdup(output);
+    }
+    int numJobs = matches.gl_pathc;
+    globfree(&matches);
+
+    return numJobs;
+}
+
+
+
+/*************************************/
+/*   PROGRAM BINARY CACHE            */    
+/*************************************/
+
+#define CACHE_MAGIC 0x42434d4bU     // "KMCB"
+
+// FNV-1a, continues from hash
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+/*
+    Cache file of a program, named by a hash of everything that changes the
+    binary: kernel source, build options, device name, device and driver
+    version. Returns 0 when there is no cache directory.
+*/
+
+static int cachePath(char *path, size_t size, cl_device_id device, const char *source, const char *buildArgs) {
+    char dir[MAX_PATH];
+    const char *env;
+
+    if ((env = getenv("KMEANS_CACHE_DIR"))) {
+        snprintf(dir, sizeof(dir), "%s", env);
+    }
+    else if ((env = getenv("XDG_CACHE_HOME"))) {
+        snprintf(dir, sizeof(dir), "%s/kmeans", env);
+    }
+    else if ((env = getenv("HOME"))) {
+        snprintf(dir, sizeof(dir), "%s/.cache", env);
+        mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/kmeans", env);
+    }
+    else {
+        return 0;
+    }
+    mkdir(dir, 0755);
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = hashBytes(hash, source, strlen(source) + 1);
+    hash = hashBytes(hash, buildArgs, strlen(buildArgs) + 1);
+
+    cl_device_info info[] = {CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION};
+    for (int j = 0; j < 3; j++) {
+        char value[1024];
+        size_t valueSize;
+        if (clGetDeviceInfo(device, info[j], sizeof(value), value, &valueSize) != CL_SUCCESS) {
+            return 0;
+        }
+        hash = hashBytes(hash, value, valueSize);
+    }
+
+    snprintf(path, size, "%s/%016llx.bin", dir, (unsigned long long) hash);
+    return 1;
+}
+
+
+// Loads and builds a cached binary, NULL when missing, stale or corrupt
+static cl_program loadCachedProgram(cl_context context, cl_device_id device, const char *path, const char *buildArgs) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+
+    unsigned int magic = 0;
+    size_t binarySize = 0;
+    unsigned char *binary = NULL;
+    cl_program program = NULL;
+
+    if (fread(&magic, sizeof(magic), 1, fp) == 1 && magic == CACHE_MAGIC &&
+        fread(&binarySize, sizeof(binarySize), 1, fp) == 1 && binarySize > 0 && binarySize < (1 << 28)) {
+
+        binary = malloc(binarySize);
+        if (fread(binary, 1, binarySize, fp) == binarySize && fgetc(fp) == EOF) {
+            cl_int status, binaryStatus;
+            program = clCreateProgramWithBinary(context, 1, &device, &binarySize,
+                                                (const unsigned char **)&binary, &binaryStatus, &status);
+            if (status != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+                if (program) clReleaseProgram(program);
+                program = NULL;
+            }
+            else if (clBuildProgram(program, 1, &device, buildArgs, NULL, NULL) != CL_SUCCESS) {
+                clReleaseProgram(program);
+                program = NULL;
+            }
+        }
+    }
+
+    free(binary);
+    fclose(fp);
+    return program;
+}
+
+
+// Writes the program binary to a temporary file and renames it, so readers never see a partial file
+static void saveCachedProgram(cl_program program, const char *path) {
+    size_t binarySize;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL) != CL_SUCCESS || binarySize == 0) {
+        return;
+    }
+
+    unsigned char *binary = malloc(binarySize);
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &binary, NULL) == CL_SUCCESS) {
+        // Room for path (built in a MAX_PATH + 32 buffer) and the pid, a truncated name could clash with another file
+        char tmpPath[MAX_PATH + 48];
+        int length = snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+
+        FILE *fp = length >= 0 && length < (int) sizeof(tmpPath) ? fopen(tmpPath, "wb") : NULL;
+        if (fp) {
+            unsigned int magic = CACHE_MAGIC;
+            int ok = fwrite(&magic, sizeof(magic), 1, fp) == 1 &&
+                     fwrite(&binarySize, sizeof(binarySize), 1, fp) == 1 &&
+                     fwrite(binary, 1, binarySize, fp) == binarySize;
+            ok = fclose(fp) == 0 && ok;
+            if (!ok || rename(tmpPath, path) != 0) {
+                remove(tmpPath);
+            }
+        }
+    }
+    free(binary);
+}
+
+
+/*
+    Builds the kernel program for one device. A binary from the on-disk
+    cache is used when it matches, otherwise the source is compiled and
+    the binary stored for the next run. cached tells which one happened.
+*/
+
+static cl_program buildProgram(cl_context context, cl_device_id device, const char *sourceStr,
+                               const char *buildArgs, int *cached) {
+    cl_int status;
+    char path[MAX_PATH + 32];
+    int useCache = cachePath(path, sizeof(path), device, sourceStr, buildArgs);
+
+    *cached = 0;
+    if (useCache) {
+        cl_program program = loadCachedProgram(context, device, path, buildArgs);
+        if (program) {
+            *cached = 1;
+            return program;
+        }
+    }
+
+    cl_program program = clCreateProgramWithSource(context, 1, &sourceStr, NULL, &status);												
+    checkStatus(status, "clCreateProgramWithSource");
+
+    status = clBuildProgram(program, 1, &device, buildArgs, NULL, NULL);
+
+    // Log kernel compilation errors
+    if (status == CL_BUILD_PROGRAM_FAILURE) {
+        size_t logSize;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+        char *log = (char *) malloc(logSize);
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, log, NULL);
+        printf("%s\n", log);
+        free(log);
+    }
+    else if (status == CL_SUCCESS && useCache) {
+        saveCachedProgram(program, path);
+    }
+
+    return program;
+}
+
+
+
+/*
+    Reads a whole kernel source file, for -k
+*/
+
+static char *readKernelSource(const char *kernelFile) {
+    FILE *fp = fopen(kernelFile, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error opening %s\n", kernelFile);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    long sourceSize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *sourceStr = malloc(sourceSize + 1);
+    sourceSize = fread(sourceStr, 1, sourceSize, fp);
+    sourceStr[sourceSize] = '\0';
+    fclose(fp);
+
+    return sourceStr;
+}
+
+
+/*
+    Sets up the OpenCL context, command queue and program once, so a batch
+    of images only pays for it once. Returns the setup time.
+*/
+
+double gpuInit(struct GPUEngine *gpu, struct KMeansParams *params, int weighted, struct GPUOptions *options) {
+
+    double startTime = omp_get_wtime();
+    cl_int status;
+    int K = params->K;
+
+    memset(gpu, 0, sizeof(struct GPUEngine));
+    gpu->K = K;
+    gpu->hamerly = params->assign == ASSIGN_HAMERLY;
+    gpu->fused = options->fused;
+    gpu->treeReduce = options->treeReduce;
+    gpu->indexSize = params->indexSize;
+    int deviceID = options->deviceID;
+
+
+    /*************************************/
+    /*      READ KERNEL SOURCE           */    
+    /*************************************/
+
+    // Embedded kernels unless another file is given for development
+    char *sourceStr = options->kernelFile ? readKernelSource(options->kernelFile) : strdup(kernelSource);
+
+    
+    /*************************************/
+    /*   DISCOVER AVAILABLE PLATFORMS    */    
+    /*************************************/
+ 
+    cl_platform_id	platforms[10];
+    cl_uint	numOfPlatforms;
+	status = clGetPlatformIDs(10, platforms, &numOfPlatforms);
+    checkStatus(status, "clGetPlatformIDs");
+
+	
+	cl_device_id devices[10];
+	cl_uint	numOfDevices;
+	status = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 10,	
+						 devices, &numOfDevices);	
+    checkStatus(status, "clGetDeviceIDs");
+
+
+    if (options->showDevices) {
+        printPlatformsInfo(devices, numOfDevices);
+    }
+        
+
+    /*************************************/
+    /*   CREATE A CONTEXT                */    
+    /*************************************/
+
+    gpu->context = clCreateContext(NULL, 1, &devices[deviceID], NULL, NULL, &status);
+    checkStatus(status, "clCreateContext");
+
+
+    /*************************************/
+    /*   CREATE A COMMAND QUEUE          */    
+    /*************************************/
+
+    gpu->commandQueue = clCreateCommandQueue(gpu->context, devices[deviceID], 0, &status);
+    checkStatus(status, "clCreateCommandQueue");
+
+    // Second queue, so uploads of the next image overlap the kernels of the current one
+    gpu->uploadQueue = clCreateCommandQueue(gpu->context, devices[deviceID], 0, &status);
+    checkStatus(status, "clCreateCommandQueue");
+
+
+    /*************************************/
+    /*   CHECK 64-BIT ATOMICS            */    
+    /*************************************/
+
+    // Cluster sums are 64-bit. Without 64-bit atomics work-groups carry between 32-bit words and need the tree reduction
+    size_t extensionsSize;
+    clGetDeviceInfo(devices[deviceID], CL_DEVICE_EXTENSIONS, 0, NULL, &extensionsSize);
+    char *extensions = malloc(extensionsSize);
+    clGetDeviceInfo(devices[deviceID], CL_DEVICE_EXTENSIONS, extensionsSize, extensions, NULL);
+    gpu->int64Atomics = strstr(extensions, "cl_khr_int64_base_atomics") != NULL;
+    int subgroups = strstr(extensions, "cl_khr_subgroups") != NULL;
+    free(extensions);
+
+    if (!gpu->int64Atomics) {
+        if (gpu->fused) {
+            fprintf(stderr, "Option -f needs a device with cl_khr_int64_base_atomics.\n");
+            exit(1);
+        }
+        if (!gpu->treeReduce) {
+            printf("Device has no 64-bit atomics, using tree reduction (-r tree)\n");
+            gpu->treeReduce = 1;
+        }
+    }
+
+
+    /*************************************/
+    /*   CHECK LOCAL MEMORY              */    
+    /*************************************/
+
+    // Work-groups keep the K centroids, one copy of their 64-bit cluster sums and a few flags in local memory.
+    // The kernels load them with loops strided by the work-group size, so local memory is the only limit on K
+    cl_ulong localMemSize;
+    clGetDeviceInfo(devices[deviceID], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMemSize), &localMemSize, NULL);
+    size_t centroidsLocal = K * sizeof(struct Color);
+    size_t countsLocal = K * 4 * sizeof(cl_long);
+    if (centroidsLocal + countsLocal + 16 > localMemSize) {
+        fprintf(stderr, "K = %d needs %zu bytes of local memory, the device has %llu. Use a smaller K or -b cpu.\n",
+                K, centroidsLocal + countsLocal + 16, (unsigned long long) localMemSize);
+        exit(1);
+    }
+
+
+    /*************************************/
+    /*   BUILD PROGRAM                   */    
+    /*************************************/
+
+    // Build program, from the binary cache when possible
+    char buildArgs[256];
+    const char *indexType = gpu->indexSize == 1 ? "uchar" : gpu->indexSize == 2 ? "ushort" : "int";
+    sprintf(buildArgs, "-DK=%d -DINDEX_T=%s -DPALETTE_TABLE_BITS=%d%s%s%s", K, indexType, PALETTE_TABLE_BITS,
+            weighted ? " -DWEIGHTED" : "", gpu->hamerly ? " -DHAMERLY" : "", gpu->int64Atomics ? " -DINT64_ATOMICS" : "");
+    if (gpu->treeReduce) {
+        // As many private counter copies as fit in 16 KB and in the device's local memory, at most 8, one per subgroup when available
+        size_t budget = localMemSize - centroidsLocal < 16384 ? localMemSize - centroidsLocal : 16384;
+        int copies = budget / countsLocal;
+        copies = copies < 1 ? 1 : copies > 8 ? 8 : copies;
+        sprintf(buildArgs + strlen(buildArgs), " -DTREE_REDUCE -DCOPIES=%d%s", copies, subgroups ? " -DSUBGROUPS" : "");
+    }
+
+    double programTime = omp_get_wtime();
+    int cached;
+    gpu->program = buildProgram(gpu->context, devices[deviceID], sourceStr, buildArgs, &cached);
+    programTime = omp_get_wtime() - programTime;
+    printf("Program: %.3fs (%s)\n", programTime, cached ? "binary cache" : "compiled from source");
+    free(sourceStr);
+
+  
+    /*************************************/
+    /*   COMPILE KERNELS                 */    
+    /*************************************/
+
+    if (gpu->fused) {
+        gpu->kernel = clCreateKernel(gpu->program, "kmeansIteration", &status);
+        checkStatus(status, "clCreateKernel");
+    }
+    else {
+        gpu->kernel = clCreateKernel(gpu->program, gpu->hamerly ? "assignToClusterHamerly" : "assignToCluster", &status);
+        checkStatus(status, "clCreateKernel");
+
+        gpu->kernel2 = clCreateKernel(gpu->program, "updateCentroids", &status);
+        checkStatus(status, "clCreateKernel");
+
+        if (gpu->hamerly) {
+            gpu->boundsKernel = clCreateKernel(gpu->program, "updateClusterBounds", &status);
+            checkStatus(status, "clCreateKernel");
+        }
+    }
+
+    if (gpu->treeReduce) {
+        gpu->reduceKernel = clCreateKernel(gpu->program, "reducePartials", &status);
+        checkStatus(status, "clCreateKernel");
+    }
+
+    gpu->mapKernel = clCreateKernel(gpu->program, "mapColors", &status);
+    checkStatus(status, "clCreateKernel");
+
+    gpu->downsampleKernel = clCreateKernel(gpu->program, "downsample", &status);
+    checkStatus(status, "clCreateKernel");
+
+    gpu->ditherKernel = clCreateKernel(gpu->program, "ditherOrdered", &status);
+    checkStatus(status, "clCreateKernel");
+
+    if (params->batchSize) {
+        gpu->batchKernel = clCreateKernel(gpu->program, "assignBatch", &status);
+        checkStatus(status, "clCreateKernel");
+
+        gpu->batchUpdateKernel = clCreateKernel(gpu->program, "updateMiniBatch", &status);
+        checkStatus(status, "clCreateKernel");
+    }
+
+
+    /*************************************/
+    /*   CREATE PER-CLUSTER BUFFERS      */    
+    /*************************************/
+
+    gpu->centroids_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, K * sizeof(struct Color), NULL, &status);
+    checkStatus(status, "clCreateBuffer");
+        
+    gpu->clusterCount_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, 4 * K * sizeof(cl_long), NULL, &status);
+    checkStatus(status, "clCreateBuffer");
+
+    gpu->maxShift_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, sizeof(int), NULL, &status);
+    checkStatus(status, "clCreateBuffer");
+
+    gpu->randIndexes_d = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY, RAND_CHUNK * K * sizeof(int), NULL, &status);
+    checkStatus(status, "clCreateBuffer");
+
+    gpu->state_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, 4 * sizeof(int), NULL, &status);
+    checkStatus(status, "clCreateBuffer");
+
+    if (gpu->hamerly) {
+        for (int j = 0; j < 3; j++) {
+            gpu->clusterBounds_d[j] = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, K * sizeof(float), NULL, &status);
+            checkStatus(status, "clCreateBuffer");
+        }
+    }
+
+    if (params->batchSize) {
+        gpu->centers_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, K * 3 * sizeof(float), NULL, &status);
+        checkStatus(status, "clCreateBuffer");
+
+        gpu->totals_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, K * sizeof(cl_long), NULL, &status);
+        checkStatus(status, "clCreateBuffer");
+    }
+
+    for (int s = 0; s < 2; s++) {
+        gpu->slots[s].weighted = weighted;
+    }
+
+    gpu->clusterCount = calloc(K * 4, sizeof(cl_long));
+    gpu->randIndexes = malloc(2 * RAND_CHUNK * K * sizeof(int));
+
+    return omp_get_wtime() - startTime;
+}
+
+
+/*
+    (Re)allocates the per point buffers of a slot when the image has more
+    points than the current capacity
+*/
+
+static void gpuReserve(struct GPUEngine *gpu, struct GPUSlot *slot, long numPoints) {
+    cl_int status;
+
+    if (numPoints <= slot->capacity) {
+        return;
+    }
+
+    if (slot->imageIn_d) clReleaseMemObject(slot->imageIn_d);
+    if (slot->weights_d) clReleaseMemObject(slot->weights_d);
+    if (slot->c_d) clReleaseMemObject(slot->c_d);
+    for (int j = 0; j < 2; j++) {
+        if (slot->bounds_d[j]) clReleaseMemObject(slot->bounds_d[j]);
+    }
+    if (slot->partials_d) clReleaseMemObject(slot->partials_d);
+
+    slot->imageIn_d = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY, numPoints * 4 * sizeof(unsigned char), NULL, &status);
+    checkStatus(status, "clCreateBuffer");
+    slot->hostImage = 0;
+
+    if (slot->weighted) {
+        slot->weights_d = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY, numPoints * sizeof(int), NULL, &status);
+        checkStatus(status, "clCreateBuffer");
+    }
+
+    slot->c_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, numPoints * gpu->indexSize, NULL, &status);
+    checkStatus(status, "clCreateBuffer");
+
+    if (gpu->hamerly) {
+        for (int j = 0; j < 2; j++) {
+            slot->bounds_d[j] = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, numPoints * sizeof(float), NULL, &status);
+            checkStatus(status, "clCreateBuffer");
+        }
+    }
+
+    if (gpu->treeReduce) {
+        long numGroups = (numPoints - 1) / 256 + 1;
+        slot->partials_d = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, numGroups * gpu->K * 4 * sizeof(cl_long), NULL, &status);
+        checkStatus(status, "clCreateBuffer");
+    }
+
+    slot->capacity = numPoints;
+}
+
+
+/*
+    Starts uploading the points of an image into a slot on the upload queue
+    and returns right away. The slot must not be in use by gpuKMeans, the
+    host memory must stay valid until the image is clustered. With zeroCopy
+    the (page aligned) points are wrapped instead of copied, devices that
+    share host memory then read them in place.
+*/
+
+void gpuUpload(struct GPUEngine *gpu, int s, unsigned char *points, int *weights, long numPoints, int zeroCopy) {
+    cl_int status;
+    const int zero = 0;
+    struct GPUSlot *slot = &gpu->slots[s];
+    cl_command_queue uploadQueue = gpu->uploadQueue;
+
+    gpuReserve(gpu, slot, numPoints);
+    slot->numPoints = numPoints;
+
+    if (zeroCopy) {
+        if (slot->imageIn_d) clReleaseMemObject(slot->imageIn_d);
+        slot->imageIn_d = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, numPoints * 4 * sizeof(unsigned char), points, &status);
+        checkStatus(status, "clCreateBuffer");
+        slot->hostImage = 1;
+    }
+    else {
+        if (slot->hostImage) {
+            if (slot->imageIn_d) clReleaseMemObject(slot->imageIn_d);
+            slot->imageIn_d = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY, slot->capacity * 4 * sizeof(unsigned char), NULL, &status);
+            checkStatus(status, "clCreateBuffer");
+            slot->hostImage = 0;
+        }
+        status = clEnqueueWriteBuffer(uploadQueue, slot->imageIn_d, CL_FALSE, 0, numPoints * 4 * sizeof(unsigned char), points, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueWriteBuffer");
+    }
+
+    if (weights) {
+        status = clEnqueueWriteBuffer(uploadQueue, slot->weights_d, CL_FALSE, 0, numPoints * sizeof(int), weights, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueWriteBuffer");
+    }
+
+    if (gpu->hamerly) {
+        // Upper bounds start at infinity, lower bounds at zero, so the first iteration scans every point
+        for (int j = 0; j < 2; j++) {
+            float fill = j == 0 ? INFINITY : 0;
+            status = clEnqueueFillBuffer(uploadQueue, slot->bounds_d[j], &fill, sizeof(float), 0, numPoints * sizeof(float), 0, NULL, NULL);
+            checkStatus(status, "clEnqueueFillBuffer");
+        }
+        status = clEnqueueFillBuffer(uploadQueue, slot->c_d, &zero, gpu->indexSize, 0, numPoints * gpu->indexSize, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueFillBuffer");
+    }
+
+    if (slot->uploaded) {
+        clReleaseEvent(slot->uploaded);
+    }
+    status = clEnqueueMarkerWithWaitList(uploadQueue, 0, NULL, &slot->uploaded);
+    checkStatus(status, "clEnqueueMarkerWithWaitList");
+    clFlush(uploadQueue);
+}
+
+
+// Drops the wrapper of the host points once an image is clustered, the encoder frees them
+static void releaseHostImage(struct GPUSlot *slot) {
+    if (slot->hostImage && slot->imageIn_d) {
+        clReleaseMemObject(slot->imageIn_d);
+        slot->imageIn_d = NULL;
+    }
+}
+
+
+/*
+    Fused mode (-f): enqueues all I iterations of kmeansIteration back to
+    back, the host only waits for the end. Centroids are updated on the
+    device by the last work-group of each launch, launches after
+    convergence return right away.
+*/
+
+static double gpuRunFused(struct GPUEngine *gpu, struct GPUSlot *slot, void *c, struct Color *centroids,
+                          struct KMeansParams *params, int *iterations, size_t globalItemSize, size_t localItemSize) {
+    cl_int status;
+    const int zero = 0;
+    int K = params->K;
+    cl_long numPoints = slot->numPoints;
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_kernel kernel = gpu->kernel;
+
+    // Seed of the device RNG for empty clusters, drawn from the per image sequence
+    cl_uint seed = rand();
+
+    // Converged once the largest squared shift is at most this, -1 (tolerance disabled) never is
+    int maxShiftLimit = params->tolerance >= 0 ? (int) floor(params->tolerance * params->tolerance) : -1;
+
+    status = clEnqueueFillBuffer(commandQueue, gpu->clusterCount_d, &zero, sizeof(int), 0, K * 4 * sizeof(cl_long), 0, NULL, NULL);
+    checkStatus(status, "clEnqueueFillBuffer");
+    status = clEnqueueFillBuffer(commandQueue, gpu->state_d, &zero, sizeof(int), 0, 4 * sizeof(int), 0, NULL, NULL);
+    checkStatus(status, "clEnqueueFillBuffer");
+
+    status = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&slot->imageIn_d);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&gpu->clusterCount_d);
+    status |= clSetKernelArg(kernel, 4, sizeof(cl_long), (void *)&numPoints);
+    status |= clSetKernelArg(kernel, 5, sizeof(cl_mem), (void *)&gpu->state_d);
+    status |= clSetKernelArg(kernel, 6, sizeof(cl_uint), (void *)&seed);
+    status |= clSetKernelArg(kernel, 7, sizeof(cl_int), (void *)&maxShiftLimit);
+    if (slot->weighted) {
+        status |= clSetKernelArg(kernel, 8, sizeof(cl_mem), (void *)&slot->weights_d);
+    }
+    checkStatus(status, "clSetKernelArg");
+
+    double startTime = omp_get_wtime();
+
+    for (int i = 0; i < params->I; i++) {
+        status = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL, &globalItemSize, &localItemSize, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueNDRangeKernel");
+    }
+
+    int state[4];
+    status = clEnqueueReadBuffer(commandQueue, gpu->state_d, CL_TRUE, 0, 4 * sizeof(int), state, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueReadBuffer");
+    *iterations = state[1];
+
+    if (c) {
+        status = clEnqueueReadBuffer(commandQueue, slot->c_d, CL_TRUE, 0, numPoints * gpu->indexSize, c, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueReadBuffer");
+    }
+
+    status = clEnqueueReadBuffer(commandQueue, gpu->centroids_d, CL_TRUE, 0, K * sizeof(struct Color), centroids, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueReadBuffer");
+
+    return omp_get_wtime() - startTime;
+}
+
+
+/*
+    Mini-batch mode (-M): every iteration assigns a batch of points drawn on
+    the device and moves each centroid towards the mean of its share of the
+    batch, see updateMiniBatch. All I iterations are enqueued back to back,
+    one full assignment pass at the end gives c and the final centroids
+    their points.
+*/
+
+static double gpuRunMiniBatch(struct GPUEngine *gpu, struct GPUSlot *slot, void *c, struct Color *centroids,
+                              struct KMeansParams *params, int *iterations, size_t globalItemSize, size_t localItemSize) {
+    cl_int status;
+    const int zero = 0;
+    int K = params->K;
+    cl_long numPoints = slot->numPoints;
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_kernel batchKernel = gpu->batchKernel;
+    cl_kernel updateKernel = gpu->batchUpdateKernel;
+
+    // Seed of the batch sampler, drawn from the per image sequence
+    cl_uint seed = rand();
+
+    int batchSize = params->batchSize < numPoints ? params->batchSize : numPoints;
+    size_t numGroups = (batchSize - 1) / localItemSize + 1;
+    size_t batchItemSize = numGroups * localItemSize;
+
+    // Exact centroid positions start at the initial centroids, (R, G, B) like clusterCount
+    float *centers = malloc(K * 3 * sizeof(float));
+    for (int j = 0; j < K; j++) {
+        centers[j*3] = centroids[j].R;
+        centers[j*3+1] = centroids[j].G;
+        centers[j*3+2] = centroids[j].B;
+    }
+    status = clEnqueueWriteBuffer(commandQueue, gpu->centers_d, CL_FALSE, 0, K * 3 * sizeof(float), centers, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueWriteBuffer");
+    status = clEnqueueFillBuffer(commandQueue, gpu->totals_d, &zero, sizeof(int), 0, K * sizeof(cl_long), 0, NULL, NULL);
+    checkStatus(status, "clEnqueueFillBuffer");
+    status = clEnqueueFillBuffer(commandQueue, gpu->clusterCount_d, &zero, sizeof(int), 0, K * 4 * sizeof(cl_long), 0, NULL, NULL);
+    checkStatus(status, "clEnqueueFillBuffer");
+
+    status = clSetKernelArg(batchKernel, 0, sizeof(cl_mem), (void *)&slot->imageIn_d);
+    status |= clSetKernelArg(batchKernel, 1, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    status |= clSetKernelArg(batchKernel, 2, sizeof(cl_mem), gpu->treeReduce ? (void *)&slot->partials_d : (void *)&gpu->clusterCount_d);
+    status |= clSetKernelArg(batchKernel, 3, sizeof(cl_long), (void *)&numPoints);
+    status |= clSetKernelArg(batchKernel, 4, sizeof(cl_int), (void *)&batchSize);
+    status |= clSetKernelArg(batchKernel, 5, sizeof(cl_uint), (void *)&seed);
+    if (slot->weighted) {
+        status |= clSetKernelArg(batchKernel, 7, sizeof(cl_mem), (void *)&slot->weights_d);
+    }
+    checkStatus(status, "clSetKernelArg");
+
+    int numGroupsArg = numGroups;
+    size_t globalItemSizeReduce[2] = {((K * 4 - 1) / 32 + 1) * 32, 8};
+    size_t localItemSizeReduce[2] = {32, 8};
+    if (gpu->treeReduce) {
+        status = clSetKernelArg(gpu->reduceKernel, 0, sizeof(cl_mem), (void *)&slot->partials_d);
+        status |= clSetKernelArg(gpu->reduceKernel, 1, sizeof(cl_int), (void *)&numGroupsArg);
+        status |= clSetKernelArg(gpu->reduceKernel, 2, sizeof(cl_mem), (void *)&gpu->clusterCount_d);
+        checkStatus(status, "clSetKernelArg");
+    }
+
+    status = clSetKernelArg(updateKernel, 0, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    status |= clSetKernelArg(updateKernel, 1, sizeof(cl_mem), (void *)&gpu->centers_d);
+    status |= clSetKernelArg(updateKernel, 2, sizeof(cl_mem), (void *)&gpu->totals_d);
+    status |= clSetKernelArg(updateKernel, 3, sizeof(cl_mem), (void *)&gpu->clusterCount_d);
+    checkStatus(status, "clSetKernelArg");
+    size_t globalItemSizeUpdate = K;
+
+    double startTime = omp_get_wtime();
+
+    for (int i = 0; i < params->I; i++) {
+        status = clSetKernelArg(batchKernel, 6, sizeof(cl_int), (void *)&i);
+        checkStatus(status, "clSetKernelArg");
+        status = clEnqueueNDRangeKernel(commandQueue, batchKernel, 1, NULL, &batchItemSize, &localItemSize, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueNDRangeKernel batch");
+
+        if (gpu->treeReduce) {
+            status = clEnqueueNDRangeKernel(commandQueue, gpu->reduceKernel, 2, NULL,
+                                        globalItemSizeReduce, localItemSizeReduce, 0, NULL, NULL);
+            checkStatus(status, "clEnqueueNDRangeKernel reduce");
+        }
+
+        status = clEnqueueNDRangeKernel(commandQueue, updateKernel, 1, NULL, &globalItemSizeUpdate, NULL, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueNDRangeKernel update");
+    }
+    *iterations = params->I;
+
+    // Final full pass, the sums it leaves in clusterCount are not used
+    cl_kernel kernel = gpu->kernel;
+    status = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&slot->imageIn_d);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), gpu->treeReduce ? (void *)&slot->partials_d : (void *)&gpu->clusterCount_d);
+    status |= clSetKernelArg(kernel, 4, sizeof(cl_long), (void *)&numPoints);
+    if (slot->weighted) {
+        status |= clSetKernelArg(kernel, 5, sizeof(cl_mem), (void *)&slot->weights_d);
+    }
+    checkStatus(status, "clSetKernelArg");
+    status = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL, &globalItemSize, &localItemSize, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueNDRangeKernel 1");
+
+    if (c) {
+        status = clEnqueueReadBuffer(commandQueue, slot->c_d, CL_TRUE, 0, numPoints * gpu->indexSize, c, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueReadBuffer");
+    }
+
+    status = clEnqueueReadBuffer(commandQueue, gpu->centroids_d, CL_TRUE, 0, K * sizeof(struct Color), centroids, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueReadBuffer");
+
+    free(centers);
+    return omp_get_wtime() - startTime;
+}
+
+
+/*
+    Runs K-means on the points uploaded into a slot. Returns time spent clustering.
+*/
+
+double gpuKMeans(struct GPUEngine *gpu, int s, void *c, struct Color *centroids,
+                 struct KMeansParams *params, int *iterations) {
+
+    cl_int status;
+    const int zero = 0;
+    int K = params->K;
+    int I = params->I;
+    double tolerance = params->tolerance;
+    int hamerly = gpu->hamerly;
+    struct GPUSlot *slot = &gpu->slots[s];
+    cl_long numPoints = slot->numPoints;
+
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_kernel kernel = gpu->kernel;
+    cl_kernel kernel2 = gpu->kernel2;
+    cl_long *clusterCount = gpu->clusterCount;
+    int *randIndexes = gpu->randIndexes;
+
+
+    /*************************************/
+    /*      DELITEV DELA                 */    
+    /*************************************/
+
+    // Kernel 1 
+    size_t localItemSize = 256;
+    size_t numGroups = ((numPoints - 1) / localItemSize + 1);
+    size_t globalItemSize = numGroups * localItemSize;
+
+    // Kernel 2 and the bounds kernel, one work-item per cluster, K may exceed the work-group size
+    size_t localItemSize2 = 64;
+    size_t globalItemSize2 = ((K - 1) / localItemSize2 + 1) * localItemSize2;
+
+
+    /*************************************/
+    /*   UPLOAD TO DEVICE BUFFERS        */    
+    /*************************************/
+
+    // Everything after this write waits for the points upload on the other queue
+    status = clEnqueueWriteBuffer(commandQueue, gpu->centroids_d, CL_FALSE, 0, K * sizeof(struct Color), centroids, 1, &slot->uploaded, NULL);
+    checkStatus(status, "clEnqueueWriteBuffer");
+
+    if (hamerly) {
+        for (int j = 0; j < 3; j++) {
+            float fill = 0;
+            status = clEnqueueFillBuffer(commandQueue, gpu->clusterBounds_d[j], &fill, sizeof(float), 0, K * sizeof(float), 0, NULL, NULL);
+            checkStatus(status, "clEnqueueFillBuffer");
+        }
+    }
+
+
+    if (gpu->fused) {
+        double elapsed = gpuRunFused(gpu, slot, c, centroids, params, iterations, globalItemSize, localItemSize);
+        releaseHostImage(slot);
+        return elapsed;
+    }
+
+    if (params->batchSize) {
+        double elapsed = gpuRunMiniBatch(gpu, slot, c, centroids, params, iterations, globalItemSize, localItemSize);
+        releaseHostImage(slot);
+        return elapsed;
+    }
+
+
+    /*************************************/
+    /*   SET KERNEL ARGUMENTS            */    
+    /*************************************/
+ 
+    // kernel1
+    status = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&slot->imageIn_d);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), gpu->treeReduce ? (void *)&slot->partials_d : (void *)&gpu->clusterCount_d);
+    status |= clSetKernelArg(kernel, 4, sizeof(cl_long), (void *)&numPoints);
+    if (hamerly) {
+        status |= clSetKernelArg(kernel, 5, sizeof(cl_mem), (void *)&slot->bounds_d[0]);
+        status |= clSetKernelArg(kernel, 6, sizeof(cl_mem), (void *)&slot->bounds_d[1]);
+        for (int j = 0; j < 3; j++) {
+            status |= clSetKernelArg(kernel, 7 + j, sizeof(cl_mem), (void *)&gpu->clusterBounds_d[j]);
+        }
+    }
+    if (slot->weighted) {
+        status |= clSetKernelArg(kernel, hamerly ? 10 : 5, sizeof(cl_mem), (void *)&slot->weights_d);
+    }
+    checkStatus(status, "clSetKernelArg");
+
+    // reduction kernel
+    int numGroupsArg = numGroups;
+    size_t globalItemSizeReduce[2] = {((K * 4 - 1) / 32 + 1) * 32, 8};
+    size_t localItemSizeReduce[2] = {32, 8};
+    if (gpu->treeReduce) {
+        status = clSetKernelArg(gpu->reduceKernel, 0, sizeof(cl_mem), (void *)&slot->partials_d);
+        status |= clSetKernelArg(gpu->reduceKernel, 1, sizeof(cl_int), (void *)&numGroupsArg);
+        status |= clSetKernelArg(gpu->reduceKernel, 2, sizeof(cl_mem), (void *)&gpu->clusterCount_d);
+        checkStatus(status, "clSetKernelArg");
+    }
+
+    // kernel2
+    status = clSetKernelArg(kernel2, 0, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    status |= clSetKernelArg(kernel2, 2, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(kernel2, 4, sizeof(cl_mem), (void *)&slot->imageIn_d);
+    status |= clSetKernelArg(kernel2, 1, sizeof(cl_mem), (void *)&gpu->clusterCount_d);
+    status |= clSetKernelArg(kernel2, 3, sizeof(cl_mem), (void *)&gpu->randIndexes_d);
+    status |= clSetKernelArg(kernel2, 5, sizeof(cl_mem), (void *)&gpu->maxShift_d);
+    if (hamerly) {
+        status |= clSetKernelArg(kernel2, 7, sizeof(cl_mem), (void *)&gpu->clusterBounds_d[0]);
+        status |= clSetKernelArg(kernel2, 8, sizeof(cl_mem), (void *)&slot->bounds_d[0]);
+        status |= clSetKernelArg(kernel2, 9, sizeof(cl_mem), (void *)&slot->bounds_d[1]);
+
+        for (int j = 0; j < 3; j++) {
+            status |= clSetKernelArg(gpu->boundsKernel, j + 1, sizeof(cl_mem), (void *)&gpu->clusterBounds_d[j]);
+        }
+        status |= clSetKernelArg(gpu->boundsKernel, 0, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    }
+    checkStatus(status, "clSetKernelArg");
+
+
+    double startTime = omp_get_wtime();
+
+
+    /*************************************/
+    /*   RUN                             */    
+    /*************************************/
+
+    // Largest squared centroid shift of the last two iterations, read back without blocking
+    int maxShift[2];
+    cl_event shiftRead[2] = {NULL, NULL};
+    cl_event randWrite[2] = {NULL, NULL};
+
+    int i = 0;
+    while (i < I) {    
+
+        // Reset clusterCount
+        status = clEnqueueFillBuffer(commandQueue, gpu->clusterCount_d, &zero, sizeof(int), 0, K * 4 * sizeof(cl_long), 0, NULL, NULL);
+        checkStatus(status, "clEnqueueFillBuffer");
+
+        status = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL,						
+                                    &globalItemSize, &localItemSize, 0, NULL, NULL);	
+        checkStatus(status, "clEnqueueNDRangeKernel 1");
+
+        if (gpu->treeReduce) {
+            status = clEnqueueNDRangeKernel(commandQueue, gpu->reduceKernel, 2, NULL,
+                                        globalItemSizeReduce, localItemSizeReduce, 0, NULL, NULL);
+            checkStatus(status, "clEnqueueNDRangeKernel reduce");
+        }
+
+        
+        // Generate sequence of random point indexes (for fixing empty clusters), RAND_CHUNK iterations at a time
+        if (i % RAND_CHUNK == 0) {
+            int half = (i / RAND_CHUNK) % 2;
+            int *chunk = randIndexes + half * RAND_CHUNK * K;
+
+            // The half was last uploaded two chunks ago, wait until the device has copied it
+            if (randWrite[half]) {
+                clWaitForEvents(1, &randWrite[half]);
+                clReleaseEvent(randWrite[half]);
+            }
+            for (int j = 0; j < RAND_CHUNK * K; j++) {
+                chunk[j] = rand() % numPoints;
+            }
+            status = clEnqueueWriteBuffer(commandQueue, gpu->randIndexes_d, CL_FALSE, 0, RAND_CHUNK * K * sizeof(int), chunk, 0, NULL, &randWrite[half]);
+            checkStatus(status, "clEnqueueWriteBuffer");
+        }
+        int randOffset = (i % RAND_CHUNK) * K;
+        status = clSetKernelArg(kernel2, 6, sizeof(cl_int), (void *)&randOffset);
+        checkStatus(status, "clSetKernelArg");                    
+
+        if (tolerance >= 0) {
+            status = clEnqueueWriteBuffer(commandQueue, gpu->maxShift_d, CL_FALSE, 0, sizeof(int), &zero, 0, NULL, NULL);
+            checkStatus(status, "clEnqueueWriteBuffer");
+        }
+
+        status = clEnqueueNDRangeKernel(commandQueue, kernel2, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL, NULL);	
+        checkStatus(status, "clEnqueueNDRangeKernel kernel 2");
+
+        if (hamerly) {
+            status = clEnqueueNDRangeKernel(commandQueue, gpu->boundsKernel, 1, NULL, &globalItemSize2, &localItemSize2, 0, NULL, NULL);
+            checkStatus(status, "clEnqueueNDRangeKernel bounds");
+        }
+
+        if (tolerance >= 0) {
+            status = clEnqueueReadBuffer(commandQueue, gpu->maxShift_d, CL_FALSE, 0, sizeof(int), &maxShift[i % 2], 0, NULL, &shiftRead[i % 2]);
+            checkStatus(status, "clEnqueueReadBuffer");
+        }
+        i++;
+
+        // Check the previous iteration while the device works on this one
+        if (tolerance >= 0 && i >= 2) {
+            clFlush(commandQueue);
+            status = clWaitForEvents(1, &shiftRead[i % 2]);
+            checkStatus(status, "clWaitForEvents");
+            clReleaseEvent(shiftRead[i % 2]);
+            shiftRead[i % 2] = NULL;
+
+            if (maxShift[i % 2] <= tolerance * tolerance) {
+                break;
+            }
+        }
+    }
+    *iterations = i;
 
     /*************************************/
-    /*   CLEANUP                         */    
-    /*************************************/
+    /*   READ RESULTS BACK TO HOST       */    
+    /*************************************/
+																	
+    // Read result from device, without c the assignments stay on the device for gpuMapColors
+    if (c) {
+        status = clEnqueueReadBuffer(commandQueue, slot->c_d, CL_TRUE, 0, numPoints * gpu->indexSize, c, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueReadBuffer");
+    }
+
+    status = clEnqueueReadBuffer(commandQueue, gpu->centroids_d, CL_TRUE, 0, K * sizeof(struct Color), centroids, 0, NULL, NULL);				
+    checkStatus(status, "clEnqueueReadBuffer");
+
+    status = clEnqueueReadBuffer(commandQueue, gpu->clusterCount_d, CL_TRUE, 0, K * 4 * sizeof(cl_long), clusterCount, 0, NULL, NULL);				
+    checkStatus(status, "clEnqueueReadBuffer");
+
+    for (int j = 0; j < 2; j++) {
+        if (shiftRead[j]) clReleaseEvent(shiftRead[j]);
+        if (randWrite[j]) clReleaseEvent(randWrite[j]);
+    }
+    releaseHostImage(slot);
+
+    return omp_get_wtime() - startTime;
+}
+
+
+/*
+    Coarse-to-fine mode (-P): downsamples the image uploaded into a slot
+    levels times on the device, runs most iterations on the coarsest level
+    and warm-starts a few iterations on every finer level with its
+    centroids, see pyramidIterations. Coarse levels stand in for the image
+    of the slot while they are clustered. Returns time spent clustering,
+    iterations is set to the total over all levels.
+*/
+
+double gpuKMeansPyramid(struct GPUEngine *gpu, int s, void *c, struct Color *centroids,
+                        struct KMeansParams *params, int *iterations, int width, int height, int levels) {
+    cl_int status;
+    const int zero = 0;
+    struct GPUSlot *slot = &gpu->slots[s];
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_kernel kernel = gpu->downsampleKernel;
+    int widths[PYRAMID_MAX + 1] = { width };
+    int heights[PYRAMID_MAX + 1] = { height };
+
+    double startTime = omp_get_wtime();
+
+    for (int l = 1; l <= levels; l++) {
+        widths[l] = (widths[l-1] + 1) / 2;
+        heights[l] = (heights[l-1] + 1) / 2;
+        long numPoints = (long) widths[l] * heights[l];
+
+        if (numPoints > gpu->pyramidCapacity[l]) {
+            if (gpu->pyramid_d[l]) clReleaseMemObject(gpu->pyramid_d[l]);
+            gpu->pyramid_d[l] = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, numPoints * 4 * sizeof(unsigned char), NULL, &status);
+            checkStatus(status, "clCreateBuffer");
+            gpu->pyramidCapacity[l] = numPoints;
+        }
+
+        status = clSetKernelArg(kernel, 0, sizeof(cl_mem), l == 1 ? (void *)&slot->imageIn_d : (void *)&gpu->pyramid_d[l-1]);
+        status |= clSetKernelArg(kernel, 1, sizeof(cl_int), (void *)&widths[l-1]);
+        status |= clSetKernelArg(kernel, 2, sizeof(cl_int), (void *)&heights[l-1]);
+        status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void *)&gpu->pyramid_d[l]);
+        checkStatus(status, "clSetKernelArg");
+
+        // The first level waits for the points upload on the other queue
+        size_t localItemSize[2] = { 64, 1 };
+        size_t globalItemSize[2] = { ((widths[l] - 1) / 64 + 1) * 64, heights[l] };
+        status = clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalItemSize, localItemSize,
+                                        l == 1 ? 1 : 0, l == 1 ? &slot->uploaded : NULL, NULL);
+        checkStatus(status, "clEnqueueNDRangeKernel");
+    }
+
+    cl_mem image_d = slot->imageIn_d;
+    int hostImage = slot->hostImage;
+    struct KMeansParams levelParams = *params;
+    *iterations = 0;
+
+    for (int l = levels; l >= 0; l--) {
+        long numPoints = (long) widths[l] * heights[l];
+        slot->imageIn_d = l > 0 ? gpu->pyramid_d[l] : image_d;
+        slot->numPoints = numPoints;
+        // gpuKMeans drops the host image wrapper, only once the full resolution is done
+        slot->hostImage = l > 0 ? 0 : hostImage;
+
+        if (gpu->hamerly) {
+            // Bounds of the previous level belong to other points, start with a full scan
+            for (int j = 0; j < 2; j++) {
+                float fill = j == 0 ? INFINITY : 0;
+                status = clEnqueueFillBuffer(commandQueue, slot->bounds_d[j], &fill, sizeof(float), 0, numPoints * sizeof(float), 0, NULL, NULL);
+                checkStatus(status, "clEnqueueFillBuffer");
+            }
+            status = clEnqueueFillBuffer(commandQueue, slot->c_d, &zero, gpu->indexSize, 0, numPoints * gpu->indexSize, 0, NULL, NULL);
+            checkStatus(status, "clEnqueueFillBuffer");
+        }
+
+        int levelIterations;
+        levelParams.I = pyramidIterations(params->I, levels, l);
+        gpuKMeans(gpu, s, l > 0 ? NULL : c, centroids, &levelParams, &levelIterations);
+        *iterations += levelIterations;
+    }
+
+    return omp_get_wtime() - startTime;
+}
+
 
-    clFlush(commandQueue);
+/*
+    Ordered dithering on the device (-D bayer|noise): replaces the
+    assignments of the image last clustered in a slot with dithered
+    palette indexes, for gpuMapColors to pick up. imageIn is the host
+    (sRGB) image, wrapped again when its device copy was already dropped.
+    Returns the time spent.
+*/
+
+double gpuDither(struct GPUEngine *gpu, int s, unsigned char *imageIn, const struct Color *centroids,
+                 int width, int height, int mode) {
+    cl_int status;
+    struct GPUSlot *slot = &gpu->slots[s];
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_kernel kernel = gpu->ditherKernel;
+    int K = gpu->K;
+
+    double startTime = omp_get_wtime();
+
+    int *table = malloc(PALETTE_TABLE_SIZE * sizeof(int));
+    buildPaletteTable(table, centroids, K);
+    float spread = paletteSpread(centroids, K);
+    int noise = mode == DITHER_NOISE;
+
+    if (!gpu->paletteTable_d) {
+        gpu->paletteTable_d = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY, PALETTE_TABLE_SIZE * sizeof(int), NULL, &status);
+        checkStatus(status, "clCreateBuffer");
+    }
+    status = clEnqueueWriteBuffer(commandQueue, gpu->paletteTable_d, CL_FALSE, 0, PALETTE_TABLE_SIZE * sizeof(int), table, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueWriteBuffer");
+
+    if (!slot->imageIn_d) {
+        slot->imageIn_d = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, (size_t) width * height * 4, imageIn, &status);
+        checkStatus(status, "clCreateBuffer");
+        slot->hostImage = 1;
+    }
+
+    status = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&slot->imageIn_d);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&gpu->paletteTable_d);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(kernel, 3, sizeof(cl_int), (void *)&width);
+    status |= clSetKernelArg(kernel, 4, sizeof(cl_int), (void *)&height);
+    status |= clSetKernelArg(kernel, 5, sizeof(cl_float), (void *)&spread);
+    status |= clSetKernelArg(kernel, 6, sizeof(cl_int), (void *)&noise);
+    checkStatus(status, "clSetKernelArg");
+
+    size_t localItemSize[2] = { 64, 1 };
+    size_t globalItemSize[2] = { ((width - 1) / 64 + 1) * 64, height };
+    status = clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalItemSize, localItemSize, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueNDRangeKernel");
+
+    // The table and a rewrapped host image are only released once the kernel is done
     clFinish(commandQueue);
-    if (kernel) clReleaseKernel(kernel);
-    if (program) clReleaseProgram(program);
-    if (imageIn_d) clReleaseMemObject(imageIn_d);
-    if (c_d) clReleaseMemObject(c_d);
-    if (centroids_d) clReleaseMemObject(centroids_d);
-
-    if (commandQueue) clReleaseCommandQueue(commandQueue);
-    if (context) clReleaseContext(context);
-	
-    free(imageIn);	
-    free(c);
-    free(centroids);
-    free(randIndexes);
+    free(table);
+    releaseHostImage(slot);
+
+    return omp_get_wtime() - startTime;
+}
+
+
+/*
+    Builds the output image of the image last clustered in a slot on the
+    device: the color in centroids of every pixel's cluster, (B, G, R, 255) or with 3
+    channels (R, G, B), rows bottom-up with flip. The kernel follows the
+    last iteration on the same queue, only the finished image is read
+    back. Returns the time spent.
+*/
+
+double gpuMapColors(struct GPUEngine *gpu, int s, const struct Color *centroids, unsigned char *imageOut,
+                    int width, int height, int channels, int flip) {
+    cl_int status;
+    struct GPUSlot *slot = &gpu->slots[s];
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_kernel kernel = gpu->mapKernel;
+    size_t size = (size_t) width * height * channels;
+
+    double startTime = omp_get_wtime();
+
+    if (size > gpu->imageOutCapacity) {
+        if (gpu->imageOut_d) clReleaseMemObject(gpu->imageOut_d);
+        gpu->imageOut_d = clCreateBuffer(gpu->context, CL_MEM_WRITE_ONLY, size, NULL, &status);
+        checkStatus(status, "clCreateBuffer");
+        gpu->imageOutCapacity = size;
+    }
+
+    // The host may have changed the centroids since the last iteration (converted back to sRGB)
+    status = clEnqueueWriteBuffer(commandQueue, gpu->centroids_d, CL_FALSE, 0, gpu->K * sizeof(struct Color), centroids, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueWriteBuffer");
+
+    status = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&slot->c_d);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&gpu->centroids_d);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&gpu->imageOut_d);
+    status |= clSetKernelArg(kernel, 3, sizeof(cl_int), (void *)&width);
+    status |= clSetKernelArg(kernel, 4, sizeof(cl_int), (void *)&height);
+    status |= clSetKernelArg(kernel, 5, sizeof(cl_int), (void *)&channels);
+    status |= clSetKernelArg(kernel, 6, sizeof(cl_int), (void *)&flip);
+    checkStatus(status, "clSetKernelArg");
 
-    return 0;
+    size_t localItemSize[2] = { 64, 1 };
+    size_t globalItemSize[2] = { ((width - 1) / 64 + 1) * 64, height };
+    status = clEnqueueNDRangeKernel(commandQueue, kernel, 2, NULL, globalItemSize, localItemSize, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueNDRangeKernel");
+
+    status = clEnqueueReadBuffer(commandQueue, gpu->imageOut_d, CL_TRUE, 0, size, imageOut, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueReadBuffer");
+
+    return omp_get_wtime() - startTime;
+}
+
+
+// Drops the whole pages of bytes [start, end) of a file mapping, they are faulted in again from the file when touched
+static void dropPages(void *mapping, size_t start, size_t end) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    start = (start + page - 1) / page * page;
+    end = end / page * page;
+    if (end > start) {
+        madvise((char *) mapping + start, end - start, MADV_DONTNEED);
+    }
+}
+
+// Waits until the band of points [start, end) is done, then drops its pages of the points and c mappings (either may be NULL)
+static void dropBand(cl_event done, unsigned char *points, void *c, int indexSize, long start, long end) {
+    clWaitForEvents(1, &done);
+    if (points) {
+        dropPages(points, (size_t) start * 4, (size_t) end * 4);
+    }
+    if (c) {
+        dropPages(c, (size_t) start * indexSize, (size_t) end * indexSize);
+    }
+}
+
+
+/*
+    Streaming mode (-B): one assignment pass over the points, band by band.
+    Bands alternate between the two slots, the upload of a band waits until
+    the slot's previous band is done, so uploads overlap the kernels of the
+    other band. Cluster sums accumulate in clusterCount_d. When c is given
+    the assignments of every band are read back into it. pointsMapped and
+    cMapped tell that points and c are file mappings (a .bgra input, a -x
+    output): the pages of a finished band are dropped, so the host holds
+    about two bands of them instead of the whole image.
+*/
+
+static void streamBands(struct GPUEngine *gpu, unsigned char *points, int *weights, long numPoints, long bandPoints,
+                        void *c, cl_event done[2], int pointsMapped, int cMapped) {
+    cl_int status;
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_command_queue uploadQueue = gpu->uploadQueue;
+    cl_kernel kernel = gpu->kernel;
+    int K = gpu->K;
+
+    int b = 0;
+    for (long start = 0; start < numPoints; start += bandPoints, b++) {
+        struct GPUSlot *slot = &gpu->slots[b % 2];
+        cl_long n = numPoints - start < bandPoints ? numPoints - start : bandPoints;
+
+        // Upload the band once the previous band in this slot is finished
+        cl_event uploaded;
+        int waitDone = done[b % 2] != NULL;
+        status = clEnqueueWriteBuffer(uploadQueue, slot->imageIn_d, CL_FALSE, 0, n * 4 * sizeof(unsigned char), points + start * 4,
+                                      waitDone, waitDone ? &done[b % 2] : NULL, NULL);
+        checkStatus(status, "clEnqueueWriteBuffer");
+        if (weights) {
+            status = clEnqueueWriteBuffer(uploadQueue, slot->weights_d, CL_FALSE, 0, n * sizeof(int), weights + start,
+                                          0, NULL, NULL);
+            checkStatus(status, "clEnqueueWriteBuffer");
+        }
+        status = clEnqueueMarkerWithWaitList(uploadQueue, 0, NULL, &uploaded);
+        checkStatus(status, "clEnqueueMarkerWithWaitList");
+        clFlush(uploadQueue);
+
+        size_t localItemSize = 256;
+        size_t numGroups = (n - 1) / localItemSize + 1;
+        size_t globalItemSize = numGroups * localItemSize;
+
+        status = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&slot->imageIn_d);
+        status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&slot->c_d);
+        status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&gpu->centroids_d);
+        status |= clSetKernelArg(kernel, 3, sizeof(cl_mem), gpu->treeReduce ? (void *)&slot->partials_d : (void *)&gpu->clusterCount_d);
+        status |= clSetKernelArg(kernel, 4, sizeof(cl_long), (void *)&n);
+        if (weights) {
+            status |= clSetKernelArg(kernel, 5, sizeof(cl_mem), (void *)&slot->weights_d);
+        }
+        checkStatus(status, "clSetKernelArg");
+
+        status = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL, &globalItemSize, &localItemSize, 1, &uploaded, NULL);
+        checkStatus(status, "clEnqueueNDRangeKernel 1");
+        clReleaseEvent(uploaded);
+
+        if (gpu->treeReduce) {
+            int numGroupsArg = numGroups;
+            size_t globalItemSizeReduce[2] = {((K * 4 - 1) / 32 + 1) * 32, 8};
+            size_t localItemSizeReduce[2] = {32, 8};
+            status = clSetKernelArg(gpu->reduceKernel, 0, sizeof(cl_mem), (void *)&slot->partials_d);
+            status |= clSetKernelArg(gpu->reduceKernel, 1, sizeof(cl_int), (void *)&numGroupsArg);
+            status |= clSetKernelArg(gpu->reduceKernel, 2, sizeof(cl_mem), (void *)&gpu->clusterCount_d);
+            checkStatus(status, "clSetKernelArg");
+
+            status = clEnqueueNDRangeKernel(commandQueue, gpu->reduceKernel, 2, NULL,
+                                        globalItemSizeReduce, localItemSizeReduce, 0, NULL, NULL);
+            checkStatus(status, "clEnqueueNDRangeKernel reduce");
+        }
+
+        if (c) {
+            status = clEnqueueReadBuffer(commandQueue, slot->c_d, CL_FALSE, 0, n * gpu->indexSize,
+                                         (char *) c + (size_t) start * gpu->indexSize, 0, NULL, NULL);
+            checkStatus(status, "clEnqueueReadBuffer");
+        }
+
+        if (done[b % 2]) {
+            clReleaseEvent(done[b % 2]);
+        }
+        status = clEnqueueMarkerWithWaitList(commandQueue, 0, NULL, &done[b % 2]);
+        checkStatus(status, "clEnqueueMarkerWithWaitList");
+        clFlush(commandQueue);
+
+        // Drop the previous band while this one runs, the last band once it is done
+        if (pointsMapped || (c && cMapped)) {
+            unsigned char *dropPoints = pointsMapped ? points : NULL;
+            void *dropC = cMapped ? c : NULL;
+            if (b > 0) {
+                dropBand(done[(b - 1) % 2], dropPoints, dropC, gpu->indexSize, start - bandPoints, start);
+            }
+            if (start + n == numPoints) {
+                dropBand(done[b % 2], dropPoints, dropC, gpu->indexSize, start, start + n);
+            }
+        }
+    }
+}
+
+
+/*
+    Runs K-means with the points streamed through the device in bands of
+    bandPoints, so device memory is bounded by the band size instead of the
+    image size. Host memory is bounded as well when points and c are file
+    mappings (see streamBands), otherwise they cover the whole image.
+    Every iteration is one streamed assignment pass; the K centroids are
+    updated on the host from the summed bands like updateCentroids does.
+    Final assignments come from one more pass with the final centroids.
+    Returns time spent clustering.
+*/
+
+double gpuKMeansStreaming(struct GPUEngine *gpu, unsigned char *points, int *weights, long numPoints, long bandPoints,
+                          void *c, struct Color *centroids, struct KMeansParams *params, int *iterations,
+                          int pointsMapped, int cMapped) {
+    cl_int status;
+    const int zero = 0;
+    int K = params->K;
+    cl_command_queue commandQueue = gpu->commandQueue;
+    cl_long *clusterCount = gpu->clusterCount;
+    int *randIndexes = gpu->randIndexes;
+
+    if (bandPoints > numPoints) {
+        bandPoints = numPoints;
+    }
+    for (int s = 0; s < 2; s++) {
+        gpuReserve(gpu, &gpu->slots[s], bandPoints);
+    }
+    cl_event done[2] = {NULL, NULL};
+
+    double startTime = omp_get_wtime();
+
+    status = clEnqueueWriteBuffer(commandQueue, gpu->centroids_d, CL_FALSE, 0, K * sizeof(struct Color), centroids, 0, NULL, NULL);
+    checkStatus(status, "clEnqueueWriteBuffer");
+
+    int i = 0;
+    while (i < params->I) {
+        status = clEnqueueFillBuffer(commandQueue, gpu->clusterCount_d, &zero, sizeof(int), 0, K * 4 * sizeof(cl_long), 0, NULL, NULL);
+        checkStatus(status, "clEnqueueFillBuffer");
+
+        streamBands(gpu, points, weights, numPoints, bandPoints, NULL, done, pointsMapped, cMapped);
+
+        status = clEnqueueReadBuffer(commandQueue, gpu->clusterCount_d, CL_TRUE, 0, K * 4 * sizeof(cl_long), clusterCount, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueReadBuffer");
+
+        // Generate sequence of random point indexes (for fixing empty clusters)
+        for (int j = 0; j < K; j++) {
+            randIndexes[j] = rand() % numPoints;
+        }
+
+        // Update centroids
+        int maxShift = 0;
+        for (int j = 0; j < K; j++) {
+            cl_long count = clusterCount[4*j+3];
+            if (count == 0) {
+                // Fix empty cluster
+                long randIndex = randIndexes[j];
+                clusterCount[4*j] += points[randIndex*4+2];
+                clusterCount[4*j+1] += points[randIndex*4+1];
+                clusterCount[4*j+2] += points[randIndex*4];
+                count = 1;
+            }
+            struct Color old = centroids[j];
+
+            centroids[j].B = clusterCount[4*j+2] / count;
+            centroids[j].G = clusterCount[4*j+1] / count;
+            centroids[j].R = clusterCount[4*j] / count;
+
+            int dB = centroids[j].B - old.B;
+            int dG = centroids[j].G - old.G;
+            int dR = centroids[j].R - old.R;
+            int shift = dB * dB + dG * dG + dR * dR;
+            if (shift > maxShift) {
+                maxShift = shift;
+            }
+        }
+
+        // Blocking, the host changes centroids again next iteration
+        status = clEnqueueWriteBuffer(commandQueue, gpu->centroids_d, CL_TRUE, 0, K * sizeof(struct Color), centroids, 0, NULL, NULL);
+        checkStatus(status, "clEnqueueWriteBuffer");
+        i++;
+
+        if (params->tolerance >= 0 && maxShift <= params->tolerance * params->tolerance) {
+            break;
+        }
+    }
+    *iterations = i;
+
+    // Final assignments, band by band
+    streamBands(gpu, points, weights, numPoints, bandPoints, c, done, pointsMapped, cMapped);
+    clFinish(commandQueue);
+
+    for (int s = 0; s < 2; s++) {
+        if (done[s]) clReleaseEvent(done[s]);
+    }
+
+    return omp_get_wtime() - startTime;
+}
+
+
+void gpuRelease(struct GPUEngine *gpu) {
+    clFlush(gpu->commandQueue);
+    clFinish(gpu->commandQueue);
+    clFinish(gpu->uploadQueue);
+    if (gpu->kernel) clReleaseKernel(gpu->kernel);
+    if (gpu->kernel2) clReleaseKernel(gpu->kernel2);
+    if (gpu->boundsKernel) clReleaseKernel(gpu->boundsKernel);
+    if (gpu->reduceKernel) clReleaseKernel(gpu->reduceKernel);
+    if (gpu->mapKernel) clReleaseKernel(gpu->mapKernel);
+    if (gpu->downsampleKernel) clReleaseKernel(gpu->downsampleKernel);
+    if (gpu->ditherKernel) clReleaseKernel(gpu->ditherKernel);
+    if (gpu->batchKernel) clReleaseKernel(gpu->batchKernel);
+    if (gpu->batchUpdateKernel) clReleaseKernel(gpu->batchUpdateKernel);
+    if (gpu->program) clReleaseProgram(gpu->program);
+    for (int s = 0; s < 2; s++) {
+        struct GPUSlot *slot = &gpu->slots[s];
+        if (slot->imageIn_d) clReleaseMemObject(slot->imageIn_d);
+        if (slot->weights_d) clReleaseMemObject(slot->weights_d);
+        if (slot->c_d) clReleaseMemObject(slot->c_d);
+        for (int j = 0; j < 2; j++) {
+            if (slot->bounds_d[j]) clReleaseMemObject(slot->bounds_d[j]);
+        }
+        if (slot->partials_d) clReleaseMemObject(slot->partials_d);
+        if (slot->uploaded) clReleaseEvent(slot->uploaded);
+    }
+    if (gpu->centroids_d) clReleaseMemObject(gpu->centroids_d);
+    if (gpu->imageOut_d) clReleaseMemObject(gpu->imageOut_d);
+    if (gpu->centers_d) clReleaseMemObject(gpu->centers_d);
+    if (gpu->totals_d) clReleaseMemObject(gpu->totals_d);
+    if (gpu->paletteTable_d) clReleaseMemObject(gpu->paletteTable_d);
+    for (int l = 0; l <= PYRAMID_MAX; l++) {
+        if (gpu->pyramid_d[l]) clReleaseMemObject(gpu->pyramid_d[l]);
+    }
+    if (gpu->clusterCount_d) clReleaseMemObject(gpu->clusterCount_d);
+    if (gpu->maxShift_d) clReleaseMemObject(gpu->maxShift_d);
+    if (gpu->randIndexes_d) clReleaseMemObject(gpu->randIndexes_d);
+    if (gpu->state_d) clReleaseMemObject(gpu->state_d);
+    for (int j = 0; j < 3; j++) {
+        if (gpu->clusterBounds_d[j]) clReleaseMemObject(gpu->clusterBounds_d[j]);
+    }
+
+    if (gpu->commandQueue) clReleaseCommandQueue(gpu->commandQueue);
+    if (gpu->uploadQueue) clReleaseCommandQueue(gpu->uploadQueue);
+    if (gpu->context) clReleaseContext(gpu->context);
+	
+    free(gpu->clusterCount);
+    free(gpu->randIndexes);
 }
 
 
@@ -4,38 +4,131 @@ struct Color {
    unsigned char B;
 };  
 
+#ifndef COPIES
+#define COPIES 1
+#endif
+
+// Cluster index type, uchar or ushort when K allows (set by the host)
+#ifndef INDEX_T
+#define INDEX_T int
+#endif
+
+/*
+    Cluster sums are 64-bit (a cluster of 8.4M white pixels already
+    overflows 32 bits, and with -u a single weighted point can). With
+    cl_khr_int64_base_atomics the work-group counters are 64-bit atomics.
+    Without it the host uses TREE_REDUCE and every local counter is a
+    (low, high) pair of 32-bit words: the low word is added atomically and
+    its carry goes into the high word, which keeps the sums exact. Work-
+    groups then write plain 64-bit partials that reducePartials adds up.
+*/
+
+typedef long count_t;
+
+#ifdef INT64_ATOMICS
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+typedef long local_count_t;
+#define COUNT_WORDS 1
+#define count_add atom_add
+#else
+#ifndef TREE_REDUCE
+#error "Devices without 64-bit atomics need TREE_REDUCE"
+#endif
+typedef uint local_count_t;
+#define COUNT_WORDS 2
+#endif
+
+void localCountAdd(__local local_count_t *counter, long value) {
+#ifdef INT64_ATOMICS
+    atom_add(counter, value);
+#else
+    uint low = (uint) value;
+    uint old = atomic_add(&counter[0], low);
+    uint carry = old + low < old;
+    atomic_add(&counter[1], (uint) ((ulong) value >> 32) + carry);
+#endif
+}
+
+long localCount(__local local_count_t *counter) {
+#ifdef INT64_ATOMICS
+    return counter[0];
+#else
+    return (long) (((ulong) counter[1] << 32) | counter[0]);
+#endif
+}
+
+/*
+    Per work-group cluster sums. With TREE_REDUCE every work-item adds into
+    one of COPIES private copies of the counters (fewer local atomic
+    conflicts), and the group writes its sums to its own slice of a scratch
+    buffer that reducePartials adds up, instead of global atomics. Copies
+    belong to subgroups when the device has cl_khr_subgroups (SUBGROUPS),
+    so subgroups never contend with each other; otherwise neighbouring
+    work-items take different copies.
+*/
+
+#ifdef SUBGROUPS
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#define COPY_ID (get_sub_group_id() % COPIES)
+#else
+#define COPY_ID (get_local_id(0) % COPIES)
+#endif
+
+void clearLocalCounts(__local local_count_t *local_clusterCount) {
+    for (int j = get_local_id(0); j < COPIES*K*4*COUNT_WORDS; j += get_local_size(0)) {
+        local_clusterCount[j] = 0;
+    }
+}
+
+void addLocalCounts(__local local_count_t *local_clusterCount, int cluster, struct Color pixel, int weight) {
+    __local local_count_t *counts = local_clusterCount + COPY_ID * K*4*COUNT_WORDS;
+    localCountAdd(&counts[(4*cluster)*COUNT_WORDS], (long) weight * pixel.R);
+    localCountAdd(&counts[(4*cluster+1)*COUNT_WORDS], (long) weight * pixel.G);
+    localCountAdd(&counts[(4*cluster+2)*COUNT_WORDS], (long) weight * pixel.B);
+    localCountAdd(&counts[(4*cluster+3)*COUNT_WORDS], weight);
+}
+
+void flushLocalCounts(__local local_count_t *local_clusterCount, __global count_t *clusterCount) {
+    for (int j = get_local_id(0); j < K*4; j += get_local_size(0)) {
+        count_t sum = 0;
+        for (int copy = 0; copy < COPIES; copy++) {
+            sum += localCount(&local_clusterCount[(copy*K*4 + j)*COUNT_WORDS]);
+        }
+#ifdef TREE_REDUCE
+        clusterCount[get_group_id(0)*K*4 + j] = sum;
+#else
+        count_add(&clusterCount[j], sum);
+#endif
+    }
+}
+
 /*
     Assignes pixel to closest cluster
 */
 
 __kernel void assignToCluster(__global unsigned char *imageIn, 
-                        __global int *c, 
+                        __global INDEX_T *c, 
                         __global struct Color *centroids, 
-                        __global int *clusterCount,
-                        int height,
-                        int width
+                        __global count_t *clusterCount,
+                        long n
+#ifdef WEIGHTED
+                        , __global int *weights
+#endif
                         ) {    
-    int locID = get_local_id(0);
-    int globID = get_global_id(0);
+    long globID = get_global_id(0);
 
-    if (globID < height * width) {
+    __local struct Color local_centroids[K];
+    __local local_count_t local_clusterCount[COPIES*K*4*COUNT_WORDS];
 
-        __local struct Color local_centroids[K];
-        __local int local_clusterCount[K*4];
+    // K may exceed the work-group size
+    for (int j = get_local_id(0); j < K; j += get_local_size(0)) {
+        local_centroids[j] = centroids[j];
+    }
+    clearLocalCounts(local_clusterCount);
 
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        if (locID < K) {
-            local_centroids[locID].R = centroids[locID].R;    
-            local_centroids[locID].G = centroids[locID].G;
-            local_centroids[locID].B = centroids[locID].B;
-
-            local_clusterCount[locID*4] = 0;
-            local_clusterCount[locID*4+1] = 0;
-            local_clusterCount[locID*4+2] = 0;
-            local_clusterCount[locID*4+3] = 0;
-        }
-        
-        barrier(CLK_LOCAL_MEM_FENCE);
+    if (globID < n) {
 
         struct Color pixel = { 
             .R = imageIn[globID*4+2], 
@@ -63,21 +156,162 @@ __kernel void assignToCluster(__global unsigned char *imageIn,
         }
 
 
-        atomic_add(&local_clusterCount[4*minIndex], pixel.R);
-        atomic_add(&local_clusterCount[4*minIndex+1], pixel.G);
-        atomic_add(&local_clusterCount[4*minIndex+2], pixel.B);
-        atomic_inc(&local_clusterCount[4*minIndex+3]);
+#ifdef WEIGHTED
+        // Point is a unique color standing for weights[globID] pixels
+        int weight = weights[globID];
+#else
+        int weight = 1;
+#endif
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+        addLocalCounts(local_clusterCount, minIndex, pixel, weight);
+
+        c[globID] = minIndex;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalCounts(local_clusterCount, clusterCount);
+}
+
+
+
+/*
+    Assigns pixel to closest cluster using Hamerly bounds, so most pixels
+    skip the scan over all K centroids. Gives the same assignments as
+    assignToCluster. Bounds are widened by BOUND_EPS on every update to
+    absorb float rounding.
+*/
+
+#define BOUND_EPS 1e-3f
+
+__kernel void assignToClusterHamerly(__global unsigned char *imageIn, 
+                        __global INDEX_T *c, 
+                        __global struct Color *centroids, 
+                        __global count_t *clusterCount,
+                        long n,
+                        __global float *upper,
+                        __global float *lower,
+                        __global float *drift,
+                        __global float *otherDrift,
+                        __global float *halfDist
+#ifdef WEIGHTED
+                        , __global int *weights
+#endif
+                        ) {    
+    long globID = get_global_id(0);
+
+    __local struct Color local_centroids[K];
+    __local local_count_t local_clusterCount[COPIES*K*4*COUNT_WORDS];
+
+    // K may exceed the work-group size
+    for (int j = get_local_id(0); j < K; j += get_local_size(0)) {
+        local_centroids[j] = centroids[j];
+    }
+    clearLocalCounts(local_clusterCount);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (globID < n) {
+
+        struct Color pixel = { 
+            .R = imageIn[globID*4+2], 
+            .G = imageIn[globID*4+1], 
+            .B = imageIn[globID*4] 
+        };
 
-        if (locID < K) {
-            atomic_add(&clusterCount[4*locID], local_clusterCount[4*locID]);
-            atomic_add(&clusterCount[4*locID+1], local_clusterCount[4*locID+1]);
-            atomic_add(&clusterCount[4*locID+2], local_clusterCount[4*locID+2]);
-            atomic_add(&clusterCount[4*locID+3], local_clusterCount[4*locID+3]); 
+        int a = c[globID];
+        float u = upper[globID] + drift[a] + BOUND_EPS;
+        float l = lower[globID] - otherDrift[a] - BOUND_EPS;
+        float m = fmax(halfDist[a], l);
+
+        if (u >= m) {
+            // Tighten upper bound
+            int dB = local_centroids[a].B - pixel.B;
+            int dG = local_centroids[a].G - pixel.G;
+            int dR = local_centroids[a].R - pixel.R;
+            u = sqrt((float) (dB * dB + dG * dG + dR * dR)) + BOUND_EPS;
+
+            if (u >= m) {
+                // Full scan for closest and second closest cluster
+                int d1 = INT_MAX;
+                int d2 = INT_MAX;
+                for (int i = 0; i < K; i++) {
+                    dB = local_centroids[i].B - pixel.B;
+                    dG = local_centroids[i].G - pixel.G;
+                    dR = local_centroids[i].R - pixel.R;
+                    int dist = dB * dB + dG * dG + dR * dR;
+
+                    if (dist < d1) {
+                        d2 = d1;
+                        d1 = dist;
+                        a = i;
+                    }
+                    else if (dist < d2) {
+                        d2 = dist;
+                    }
+                }
+                u = sqrt((float) d1) + BOUND_EPS;
+                l = sqrt((float) d2) - BOUND_EPS;
+            }
         }
+        upper[globID] = u;
+        lower[globID] = l;
 
-        c[globID] = minIndex;
+#ifdef WEIGHTED
+        int weight = weights[globID];
+#else
+        int weight = 1;
+#endif
+
+        addLocalCounts(local_clusterCount, a, pixel, weight);
+
+        c[globID] = a;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalCounts(local_clusterCount, clusterCount);
+}
+
+
+
+/*
+    Adds up the per work-group slices written with TREE_REDUCE. Work-items
+    in a row read consecutive counters, rows take every REDUCE_ROWS-th
+    slice, then the rows are summed in a tree in local memory. Adds to
+    clusterCount, so streamed bands accumulate.
+*/
+
+#define REDUCE_COLS 32
+#define REDUCE_ROWS 8
+
+__kernel void reducePartials(__global count_t *partials, 
+                            int numGroups, 
+                            __global long *clusterCount) {
+    int col = get_global_id(0);
+    int locCol = get_local_id(0);
+    int row = get_local_id(1);
+
+    __local long sums[REDUCE_ROWS][REDUCE_COLS];
+
+    long sum = 0;
+    if (col < K*4) {
+        for (int g = row; g < numGroups; g += REDUCE_ROWS) {
+            sum += partials[(long) g*K*4 + col];
+        }
+    }
+    sums[row][locCol] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = REDUCE_ROWS / 2; stride > 0; stride /= 2) {
+        if (row < stride) {
+            sums[row][locCol] += sums[row + stride][locCol];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (row == 0 && col < K*4) {
+        clusterCount[col] += sums[0][locCol];
     }
 }
 
@@ -88,30 +322,478 @@ __kernel void assignToCluster(__global unsigned char *imageIn,
 */
 
 __kernel void updateCentroids(__global struct Color *centroids, 
-                            __global int *clusterCount, 
-                            __global int *c, 
+                            __global long *clusterCount, 
+                            __global INDEX_T *c, 
                             __global int *randIndexes,
-                            __global unsigned char *imageIn
+                            __global unsigned char *imageIn,
+                            __global int *maxShift,
+                            int randOffset
+#ifdef HAMERLY
+                            , __global float *drift,
+                            __global float *upper,
+                            __global float *lower
+#endif
                             ) {
     int globID = get_global_id(0);
 
     if (globID < K) {    
-        int count = clusterCount[4*globID+3];
+        long count = clusterCount[4*globID+3];
         
         if (count == 0) {
             // Fix empty cluster
-            int randIndex = randIndexes[globID];
+            long randIndex = randIndexes[randOffset + globID];
             c[randIndex] = globID;
+#ifdef HAMERLY
+            // Bounds belong to the old cluster, force a full scan
+            upper[randIndex] = INFINITY;
+            lower[randIndex] = 0;
+#endif
 
-            atomic_add(&clusterCount[4*globID], imageIn[randIndex*4+2]);
-            atomic_add(&clusterCount[4*globID+1], imageIn[randIndex*4+1]);
-            atomic_add(&clusterCount[4*globID+2], imageIn[randIndex*4]);
-            atomic_inc(&clusterCount[4*globID+3]);
+            // Only this work-item touches the sums of its cluster
+            clusterCount[4*globID] += imageIn[randIndex*4+2];
+            clusterCount[4*globID+1] += imageIn[randIndex*4+1];
+            clusterCount[4*globID+2] += imageIn[randIndex*4];
+            clusterCount[4*globID+3]++;
             
             count = 1;
         }
+        struct Color old = centroids[globID];
+
         centroids[globID].B = clusterCount[4*globID+2] / count;
         centroids[globID].G = clusterCount[4*globID+1] / count; 
         centroids[globID].R = clusterCount[4*globID] / count;         
+
+        // Track largest (squared) centroid shift for convergence check
+        int dB = centroids[globID].B - old.B;
+        int dG = centroids[globID].G - old.G;
+        int dR = centroids[globID].R - old.R;
+        atomic_max(maxShift, dB * dB + dG * dG + dR * dR);
+#ifdef HAMERLY
+        drift[globID] = sqrt((float) (dB * dB + dG * dG + dR * dR));
+#endif
     }    
+
+}
+
+
+
+/*
+    Hamerly bounds per centroid, after updateCentroids: half the distance
+    to the closest other centroid and the largest drift of the other
+    centroids. A launch of its own, so it sees all new centroids whatever
+    the number of work-groups.
+*/
+
+#ifdef HAMERLY
+__kernel void updateClusterBounds(__global struct Color *centroids,
+                            __global float *drift,
+                            __global float *otherDrift,
+                            __global float *halfDist) {
+    int i = get_global_id(0);
+
+    if (i < K) {
+        struct Color centroid = centroids[i];
+        int minDist = INT_MAX;
+        float maxDrift = 0;
+        for (int j = 0; j < K; j++) {
+            if (j == i) {
+                continue;
+            }
+            int dB = centroids[j].B - centroid.B;
+            int dG = centroids[j].G - centroid.G;
+            int dR = centroids[j].R - centroid.R;
+            minDist = min(minDist, dB * dB + dG * dG + dR * dR);
+            maxDrift = fmax(maxDrift, drift[j]);
+        }
+        halfDist[i] = 0.5f * sqrt((float) minDist) - BOUND_EPS;
+        otherDrift[i] = maxDrift;
+    }
+}
+#endif
+
+
+
+/*
+    Fused iteration for -f: assignment and centroid update in one launch, so
+    all I iterations are enqueued back to back with no host work between
+    them. Work-groups assign like assignToCluster, the last work-group to
+    finish updates the centroids like updateCentroids and resets the
+    counters for the next launch. state holds (groups done, iterations run,
+    largest squared shift, converged flag). Random indexes for empty
+    clusters come from a hash of (seed, iteration, cluster). Only built
+    with INT64_ATOMICS, it needs them for the global sums.
+*/
+
+#ifdef INT64_ATOMICS
+#define STATE_DONE 0
+#define STATE_ITERATIONS 1
+#define STATE_MAX_SHIFT 2
+#define STATE_CONVERGED 3
+
+uint randomIndex(uint seed, uint iteration, uint cluster, uint n) {
+    uint x = seed ^ ((iteration * K + cluster) * 0x9E3779B9u);
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x % n;
+}
+
+__kernel void kmeansIteration(__global unsigned char *imageIn, 
+                        __global INDEX_T *c, 
+                        __global struct Color *centroids, 
+                        __global long *clusterCount,
+                        long n,
+                        __global int *state,
+                        uint seed,
+                        int maxShiftLimit
+#ifdef WEIGHTED
+                        , __global int *weights
+#endif
+                        ) {    
+    // Converged in an earlier launch, the remaining launches do nothing
+    if (state[STATE_CONVERGED]) {
+        return;
+    }
+
+    int locID = get_local_id(0);
+    long globID = get_global_id(0);
+    int localSize = get_local_size(0);
+
+    __local struct Color local_centroids[K];
+    __local local_count_t local_clusterCount[COPIES*K*4*COUNT_WORDS];
+    __local int isLast;
+
+    for (int j = locID; j < K; j += localSize) {
+        local_centroids[j] = centroids[j];
+    }
+    clearLocalCounts(local_clusterCount);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (globID < n) {
+        struct Color pixel = { 
+            .R = imageIn[globID*4+2], 
+            .G = imageIn[globID*4+1], 
+            .B = imageIn[globID*4] 
+        };
+
+        int minDist = INT_MAX;
+        int minIndex = 0;
+
+        // Assign pixel to closest cluster        
+        for (int i = 0; i < K; i++) {
+            int dB = local_centroids[i].B - pixel.B;
+            int dG = local_centroids[i].G - pixel.G;
+            int dR = local_centroids[i].R - pixel.R;
+            int dist = dB * dB + dG * dG + dR * dR;
+
+            if (dist < minDist) {
+                minIndex = i;
+                minDist = dist;
+            }
+        }
+
+#ifdef WEIGHTED
+        int weight = weights[globID];
+#else
+        int weight = 1;
+#endif
+
+        addLocalCounts(local_clusterCount, minIndex, pixel, weight);
+
+        c[globID] = minIndex;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Never built with TREE_REDUCE, so this adds into the global sums atomically
+    flushLocalCounts(local_clusterCount, clusterCount);
+
+    // Make this group's sums and assignments visible before counting it as done
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
+
+    if (locID == 0) {
+        isLast = atomic_inc(&state[STATE_DONE]) == get_num_groups(0) - 1;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (!isLast) {
+        return;
+    }
+
+    // Last group: update centroids, reading and clearing the sums atomically
+    uint iteration = state[STATE_ITERATIONS];
+    for (int j = locID; j < K; j += localSize) {
+        long sumR = atom_xchg(&clusterCount[4*j], 0);
+        long sumG = atom_xchg(&clusterCount[4*j+1], 0);
+        long sumB = atom_xchg(&clusterCount[4*j+2], 0);
+        long count = atom_xchg(&clusterCount[4*j+3], 0);
+
+        if (count == 0) {
+            // Fix empty cluster
+            long randIndex = randomIndex(seed, iteration, j, n);
+            c[randIndex] = j;
+
+            sumR = imageIn[randIndex*4+2];
+            sumG = imageIn[randIndex*4+1];
+            sumB = imageIn[randIndex*4];
+            count = 1;
+        }
+        struct Color old = centroids[j];
+
+        centroids[j].B = sumB / count;
+        centroids[j].G = sumG / count;
+        centroids[j].R = sumR / count;
+
+        int dB = centroids[j].B - old.B;
+        int dG = centroids[j].G - old.G;
+        int dR = centroids[j].R - old.R;
+        atomic_max(&state[STATE_MAX_SHIFT], dB * dB + dG * dG + dR * dR);
+    }
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    if (locID == 0) {
+        state[STATE_DONE] = 0;
+        state[STATE_ITERATIONS] = iteration + 1;
+        if (atomic_xchg(&state[STATE_MAX_SHIFT], 0) <= maxShiftLimit) {
+            state[STATE_CONVERGED] = 1;
+        }
+    }
+}
+#endif
+
+
+
+/*
+    Mini-batch k-means. Every work-item draws one point from a counter based
+    RNG, so a batch costs the same for any image size, and adds it to the
+    sums of its closest centroid. Sums are flushed like in assignToCluster.
+*/
+
+uint batchIndex(uint seed, uint iteration, uint i, uint n) {
+    uint x = seed ^ ((iteration * 0x01000193u + i) * 0x9E3779B9u);
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x % n;
+}
+
+__kernel void assignBatch(__global unsigned char *imageIn,
+                        __global struct Color *centroids,
+                        __global count_t *clusterCount,
+                        long n,
+                        int batchSize,
+                        uint seed,
+                        int iteration
+#ifdef WEIGHTED
+                        , __global int *weights
+#endif
+                        ) {
+    int locID = get_local_id(0);
+    int globID = get_global_id(0);
+
+    __local struct Color local_centroids[K];
+    __local local_count_t local_clusterCount[COPIES*K*4*COUNT_WORDS];
+
+    for (int j = locID; j < K; j += get_local_size(0)) {
+        local_centroids[j] = centroids[j];
+    }
+    clearLocalCounts(local_clusterCount);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (globID < batchSize) {
+        long p = batchIndex(seed, iteration, globID, n);
+        struct Color pixel = {
+            .R = imageIn[p*4+2],
+            .G = imageIn[p*4+1],
+            .B = imageIn[p*4]
+        };
+
+        int minDist = INT_MAX;
+        int minIndex = 0;
+        for (int i = 0; i < K; i++) {
+            int dB = local_centroids[i].B - pixel.B;
+            int dG = local_centroids[i].G - pixel.G;
+            int dR = local_centroids[i].R - pixel.R;
+            int dist = dB * dB + dG * dG + dR * dR;
+            if (dist < minDist) {
+                minIndex = i;
+                minDist = dist;
+            }
+        }
+
+#ifdef WEIGHTED
+        int weight = weights[p];
+#else
+        int weight = 1;
+#endif
+        addLocalCounts(local_clusterCount, minIndex, pixel, weight);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    flushLocalCounts(local_clusterCount, clusterCount);
+}
+
+
+
+/*
+    Mini-batch centroid update with a per-centroid learning rate (count of
+    the batch over all points the centroid has seen), which makes every
+    centroid the running mean of its points. centers keeps the exact (R, G, B)
+    position, centroids its rounded color. Clears clusterCount for the next
+    batch.
+*/
+
+__kernel void updateMiniBatch(__global struct Color *centroids,
+                            __global float *centers,
+                            __global long *totals,
+                            __global long *clusterCount) {
+    int j = get_global_id(0);
+
+    if (j < K) {
+        long count = clusterCount[4*j+3];
+        if (count > 0) {
+            totals[j] += count;
+            float rate = (float) count / totals[j];
+            for (int ch = 0; ch < 3; ch++) {
+                float mean = (float) clusterCount[4*j+ch] / count;
+                centers[3*j+ch] += rate * (mean - centers[3*j+ch]);
+            }
+            centroids[j].R = (uchar) (centers[3*j] + 0.5f);
+            centroids[j].G = (uchar) (centers[3*j+1] + 0.5f);
+            centroids[j].B = (uchar) (centers[3*j+2] + 0.5f);
+        }
+        for (int ch = 0; ch < 4; ch++) {
+            clusterCount[4*j+ch] = 0;
+        }
+    }
+}
+
+
+
+/*
+    Writes the output image, the centroid color of every pixel: (B, G, R, 255)
+    or (R, G, B) with 3 channels. With flip the rows are stored bottom-up,
+    the way FreeImage keeps them.
+*/
+
+__kernel void mapColors(__global INDEX_T *c,
+                        __global struct Color *centroids,
+                        __global unsigned char *imageOut,
+                        int width,
+                        int height,
+                        int channels,
+                        int flip) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x < width && y < height) {
+        struct Color color = centroids[c[(long) y * width + x]];
+        int row = flip ? height - 1 - y : y;
+        __global unsigned char *out = imageOut + ((size_t) row * width + x) * channels;
+        if (channels == 4) {
+            out[0] = color.B;
+            out[1] = color.G;
+            out[2] = color.R;
+            out[3] = 255;
+        }
+        else {
+            out[0] = color.R;
+            out[1] = color.G;
+            out[2] = color.B;
+        }
+    }
+}
+
+
+
+/*
+    One pyramid level for coarse-to-fine mode: every (B, G, R, A) point is
+    the rounded mean of a 2x2 block of the level below, edge pixels are
+    repeated for odd sizes.
+*/
+
+__kernel void downsample(__global unsigned char *src,
+                        int srcWidth,
+                        int srcHeight,
+                        __global unsigned char *dst) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int width = (srcWidth + 1) / 2;
+    int height = (srcHeight + 1) / 2;
+
+    if (x < width && y < height) {
+        int x0 = 2 * x;
+        int x1 = min(2 * x + 1, srcWidth - 1);
+        long y0 = 2L * y * srcWidth;
+        long y1 = (long) min(2 * y + 1, srcHeight - 1) * srcWidth;
+        for (int ch = 0; ch < 4; ch++) {
+            int sum = src[(y0 + x0) * 4 + ch] + src[(y0 + x1) * 4 + ch] +
+                      src[(y1 + x0) * 4 + ch] + src[(y1 + x1) * 4 + ch];
+            dst[((long) y * width + x) * 4 + ch] = (sum + 2) >> 2;
+        }
+    }
+}
+
+
+
+/*
+    Ordered dithering on the output palette: every pixel is offset by a
+    threshold in [-spread/2, spread/2) from the 8x8 Bayer matrix or, with
+    noise, from interleaved gradient noise, and mapped to a palette index
+    through table (the nearest palette color of every RGB cell, indexed by
+    the top PALETTE_TABLE_BITS bits of each channel like paletteIndex on the
+    host). Replaces the assignments in c, pixels are independent.
+*/
+
+// Set by the host from kmeans.h
+#ifndef PALETTE_TABLE_BITS
+#define PALETTE_TABLE_BITS 6
+#endif
+
+__constant uchar bayer[64] = {
+     0, 32,  8, 40,  2, 34, 10, 42,
+    48, 16, 56, 24, 50, 18, 58, 26,
+    12, 44,  4, 36, 14, 46,  6, 38,
+    60, 28, 52, 20, 62, 30, 54, 22,
+     3, 35, 11, 43,  1, 33,  9, 41,
+    51, 19, 59, 27, 49, 17, 57, 25,
+    15, 47,  7, 39, 13, 45,  5, 37,
+    63, 31, 55, 23, 61, 29, 53, 21
+};
+
+__kernel void ditherOrdered(__global unsigned char *imageIn,
+                        __global int *table,
+                        __global INDEX_T *c,
+                        int width,
+                        int height,
+                        float spread,
+                        int noise) {
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x < width && y < height) {
+        float t;
+        if (noise) {
+            float f = 0.06711056f * x + 0.00583715f * y;
+            f = 52.9829189f * (f - floor(f));
+            t = f - floor(f);
+        }
+        else {
+            t = (bayer[(y & 7) * 8 + (x & 7)] + 0.5f) / 64;
+        }
+        int offset = (int) floor((t - 0.5f) * spread + 0.5f);
+        long p = (long) y * width + x;
+        int R = clamp(imageIn[p*4+2] + offset, 0, 255);
+        int G = clamp(imageIn[p*4+1] + offset, 0, 255);
+        int B = clamp(imageIn[p*4] + offset, 0, 255);
+        int shift = 8 - PALETTE_TABLE_BITS;
+        c[p] = table[((R >> shift) << (2 * PALETTE_TABLE_BITS)) | ((G >> shift) << PALETTE_TABLE_BITS) | (B >> shift)];
+    }
 }
@@ -0,0 +1,168 @@
+#ifndef KMEANS_H
+#define KMEANS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+struct Color {
+   unsigned char R;
+   unsigned char G;
+   unsigned char B;
+};  
+
+// Unique colors of an image with pixel counts
+struct ColorTable {
+    int numColors;
+    unsigned char *colors;      // (B, G, R, A) for each unique color
+    int *weights;               // number of pixels of each color
+    uint64_t *present;          // bitmap of present 24-bit colors
+    int *rank;                  // number of present colors before each bitmap word
+};
+
+#define ASSIGN_BRUTE 0
+#define ASSIGN_HAMERLY 1
+
+// Clustering settings shared by both engines
+struct KMeansParams {
+    int K;                  // number of clusters
+    int I;                  // maximum number of iterations
+    double tolerance;       // stop once no centroid moved more than this, disabled when negative
+    int assign;             // ASSIGN_BRUTE scans all centroids, ASSIGN_HAMERLY prunes with distance bounds
+    int indexSize;          // bytes per cluster index in c, see indexSize()
+    int batchSize;          // points per mini-batch iteration, 0 runs full Lloyd iterations
+};
+
+/*
+    Cluster indexes are stored as narrow as K allows: uchar for K <= 256,
+    ushort for K <= 65536, int otherwise.
+*/
+
+static inline int indexSize(int K) {
+    return K <= 256 ? 1 : K <= 65536 ? 2 : 4;
+}
+
+static inline int getIndex(const void *c, int size, long i) {
+    return size == 1 ? ((const uint8_t *) c)[i] : size == 2 ? ((const uint16_t *) c)[i] : ((const int *) c)[i];
+}
+
+static inline void setIndex(void *c, int size, long i, int index) {
+    if (size == 1) ((uint8_t *) c)[i] = index;
+    else if (size == 2) ((uint16_t *) c)[i] = index;
+    else ((int *) c)[i] = index;
+}
+
+/*
+    Point counts and pixel offsets are long on both engines. Loaders accept
+    up to MAX_PIXELS pixels (8 GB as BGRA), so the pixel count of a single
+    color still fits its int weight with -u.
+*/
+
+#define MAX_PIXELS 0x7FFFFFFFL
+
+/*
+    Coarse-to-fine mode: every pyramid level halves the width and height of
+    the one below it (2x2 box filter), level 0 is the image itself. Finer
+    levels refine the centroids with I/16 iterations each (at least one),
+    the coarsest level runs the rest.
+*/
+
+#define PYRAMID_MAX 8
+
+static inline int pyramidIterations(int I, int levels, int level) {
+    int refine = I / 16 > 1 ? I / 16 : 1;
+    int coarse = I - refine * levels;
+    return level < levels ? refine : coarse > 1 ? coarse : 1;
+}
+
+/*
+    Engines cluster numPoints (B, G, R, A) points. weights is the number of
+    pixels each point stands for, NULL when every point is a single pixel.
+    iterations is set to the number of iterations run. c receives
+    params->indexSize byte indexes; the CPU engine works on int indexes
+    internally, so its c needs room for numPoints ints.
+*/
+
+/*   CPU backend (cpu.c)    */
+
+double cpuKMeans(unsigned char *points, int *weights, long numPoints, void *c, struct Color *centroids,
+                 struct KMeansParams *params, int *iterations);
+const char *cpuSimdName(void);
+double cpuKMeansPyramid(unsigned char *points, int width, int height, int levels, void *c, struct Color *centroids,
+                        struct KMeansParams *params, int *iterations);
+
+/*   k-means|| seeding (seed.c)    */
+
+void seedCentroids(const unsigned char *points, const int *weights, long numPoints, struct Color *centroids, int K,
+                   unsigned int seed);
+
+/*   perceptual color spaces (color.c)    */
+
+#define COLOR_RGB 0
+#define COLOR_OKLAB 1
+#define COLOR_LAB 2
+
+void pointsToColorSpace(unsigned char *points, long numPoints, int space);
+void colorsToColorSpace(struct Color *colors, int n, int space);
+void colorsToSRGB(struct Color *colors, int n, int space);
+
+/*   dithering on the output palette (dither.c)    */
+
+#define DITHER_NONE 0
+#define DITHER_FS 1                     // Floyd-Steinberg error diffusion
+#define DITHER_BAYER 2                  // ordered, 8x8 Bayer matrix
+#define DITHER_NOISE 3                  // ordered, interleaved gradient noise
+
+#define PALETTE_TABLE_BITS 6
+#define PALETTE_TABLE_SIZE (1 << (3 * PALETTE_TABLE_BITS))
+
+static inline int paletteIndex(int R, int G, int B) {
+    int shift = 8 - PALETTE_TABLE_BITS;
+    return ((R >> shift) << (2 * PALETTE_TABLE_BITS)) | ((G >> shift) << PALETTE_TABLE_BITS) | (B >> shift);
+}
+
+void buildPaletteTable(int *table, const struct Color *palette, int K);
+float paletteSpread(const struct Color *palette, int K);
+double ditherImage(const unsigned char *imageIn, int width, int height, const struct Color *palette, int K,
+                   void *c, int indexSize, int mode);
+
+/*   color histogram compaction (compact.c)    */
+
+void buildColorTable(struct ColorTable *table, unsigned char *imageIn, long numPixels);
+void mapColorTable(struct ColorTable *table, unsigned char *imageIn, long numPixels, const void *colorClusters, void *c,
+                   int indexSize);
+void freeColorTable(struct ColorTable *table);
+
+/*   zlib PNG codec with parallel deflate (png.c)    */
+
+unsigned char *pngLoad(const char *fileName, int *width, int *height, int threads);
+int pngSave(const char *fileName, const unsigned char *pixels, int width, int height, int channels,
+            const struct Color *palette, int paletteSize, int threads);
+
+/*   raw frames and PPM/PAM through mmap (raw.c)    */
+
+int isRawFile(const char *fileName);
+unsigned char *rawLoad(const char *fileName, int *width, int *height, size_t *mapped);
+void rawUnload(unsigned char *imageIn, size_t mapped);
+void *rawMapIndexes(const char *fileName, size_t size);
+int rawSaveIndexes(const char *fileName, void *c, size_t mapped, long numPixels, int indexSize,
+                   const struct Color *centroids, int K);
+
+/*   bounded in-order queue between pipeline stages (queue.c)    */
+
+struct Queue {
+    void **items;               // ring of capacity slots, NULL when empty
+    int capacity;
+    int head;                   // sequence number of the next item to take
+    int end;                    // total number of items that will pass the queue
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+void queueInit(struct Queue *queue, int capacity, int end);
+void queuePut(struct Queue *queue, int seq, void *item);
+void *queueGet(struct Queue *queue);
+void *queueTryGet(struct Queue *queue);
+void queueFree(struct Queue *queue);
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <omp.h>
+#include <zlib.h>
+#include "kmeans.h"
+
+#define CHUNK_BYTES (256 * 1024)        // filtered bytes deflated by one thread
+#define DICT_BYTES 32768                // deflate window, primed from the previous chunk
+#define IDAT_BYTES (1 << 20)            // largest IDAT chunk written
+#define BAND_ROWS 64                    // rows inflated and unfiltered at once
+
+static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+
+static inline uint32_t readU32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline void writeU32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+
+/*************************************/
+/*   DECODE                          */
+/*************************************/
+
+// Reverses the filter of one row in place, prev is the previous unfiltered row or NULL
+static int unfilterRow(unsigned char *row, const unsigned char *prev, int rowBytes, int bpp) {
+    int filter = row[-1];
+    switch (filter) {
+        case 0:
+            break;
+        case 1:
+            for (int i = bpp; i < rowBytes; i++) row[i] += row[i-bpp];
+            break;
+        case 2:
+            if (prev) for (int i = 0; i < rowBytes; i++) row[i] += prev[i];
+            break;
+        case 3:
+            for (int i = 0; i < rowBytes; i++) {
+                int left = i >= bpp ? row[i-bpp] : 0;
+                int up = prev ? prev[i] : 0;
+                row[i] += (left + up) >> 1;
+            }
+            break;
+        case 4:
+            for (int i = 0; i < rowBytes; i++) {
+                int left = i >= bpp ? row[i-bpp] : 0;
+                int up = prev ? prev[i] : 0;
+                int upLeft = prev && i >= bpp ? prev[i-bpp] : 0;
+                row[i] += paeth(left, up, upLeft);
+            }
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+
+/*
+    Loads an 8-bit, non-interlaced PNG into a top-down (B, G, R, A) buffer
+    with a pitch of width * 4, the layout the FreeImage path produces.
+    Returns NULL for anything else (other bit depths, interlacing, corrupt
+    files), the caller then falls back to FreeImage. Inflating is inherently
+    serial, it is interleaved with unfiltering band by band so the rows are
+    still in cache; the conversion to BGRA runs on threads threads.
+*/
+
+unsigned char *pngLoad(const char *fileName, int *width, int *height, int threads) {
+
+    FILE *f = fopen(fileName, "rb");
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *file = malloc(size);
+    if (fread(file, 1, size, f) != (size_t) size || size < 8 || memcmp(file, signature, 8) != 0) {
+        fclose(f);
+        free(file);
+        return NULL;
+    }
+    fclose(f);
+
+    int w = 0, h = 0, colorType = -1, bitDepth = 0, interlace = 0;
+    unsigned char palette[256 * 3] = { 0 };
+    z_stream strm = { 0 };
+    inflateInit(&strm);
+
+    unsigned char *filtered = NULL;
+    unsigned char *imageOut = NULL;
+    int channels = 0, rowBytes = 0, rowsDone = 0, ok = 0;
+    long stride = 0;
+
+    long pos = 8;
+    while (pos + 12 <= size) {
+        uint32_t length = readU32(file + pos);
+        const unsigned char *type = file + pos + 4;
+        const unsigned char *data = file + pos + 8;
+        if (length > (uint32_t) (size - pos - 12) || crc32(0, type, length + 4) != readU32(data + length)) {
+            break;
+        }
+        pos += 12 + length;
+
+        if (memcmp(type, "IHDR", 4) == 0 && length == 13) {
+            w = readU32(data);
+            h = readU32(data + 4);
+            bitDepth = data[8];
+            colorType = data[9];
+            interlace = data[12];
+            channels = colorType == 0 ? 1 : colorType == 2 ? 3 : colorType == 3 ? 1 : colorType == 4 ? 2 : colorType == 6 ? 4 : 0;
+            if (bitDepth != 8 || interlace != 0 || channels == 0 || w <= 0 || h <= 0 || w > INT32_MAX / 4 || (long) w * h > MAX_PIXELS) {
+                break;
+            }
+            rowBytes = w * channels;
+            stride = rowBytes + 1;
+            filtered = malloc(stride * h);
+            strm.next_out = filtered;
+            strm.avail_out = 0;
+        }
+        else if (memcmp(type, "PLTE", 4) == 0 && length <= sizeof(palette)) {
+            memcpy(palette, data, length);
+        }
+        else if (memcmp(type, "IDAT", 4) == 0 && filtered) {
+            strm.next_in = (unsigned char *) data;
+            strm.avail_in = length;
+            while (strm.avail_in > 0 && rowsDone < h) {
+                // Inflate up to the end of the current band, then unfilter the rows completed so far
+                long bandEnd = stride * (rowsDone + BAND_ROWS < h ? rowsDone + BAND_ROWS : h);
+                strm.avail_out = bandEnd - (strm.next_out - filtered);
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END) {
+                    goto done;
+                }
+                int rowsOut = (strm.next_out - filtered) / stride;
+                for (; rowsDone < rowsOut; rowsDone++) {
+                    unsigned char *row = filtered + stride * rowsDone + 1;
+                    if (!unfilterRow(row, rowsDone ? row - stride : NULL, rowBytes, channels)) {
+                        goto done;
+                    }
+                }
+                if (ret == Z_STREAM_END) {
+                    break;
+                }
+            }
+        }
+        else if (memcmp(type, "IEND", 4) == 0) {
+            ok = filtered && rowsDone == h;
+            break;
+        }
+    }
+
+    if (ok) {
+        imageOut = malloc((size_t) w * h * 4);
+        #pragma omp parallel for schedule(static) num_threads(threads)
+        for (int y = 0; y < h; y++) {
+            const unsigned char *row = filtered + stride * y + 1;
+            unsigned char *out = imageOut + (size_t) y * w * 4;
+            for (int x = 0; x < w; x++, out += 4) {
+                switch (colorType) {
+                    case 0:
+                        out[0] = out[1] = out[2] = row[x]; out[3] = 255;
+                        break;
+                    case 2:
+                        out[0] = row[x*3+2]; out[1] = row[x*3+1]; out[2] = row[x*3]; out[3] = 255;
+                        break;
+                    case 3:
+                        out[0] = palette[row[x]*3+2]; out[1] = palette[row[x]*3+1]; out[2] = palette[row[x]*3]; out[3] = 255;
+                        break;
+                    case 4:
+                        out[0] = out[1] = out[2] = row[x*2]; out[3] = row[x*2+1];
+                        break;
+                    default:
+                        out[0] = row[x*4+2]; out[1] = row[x*4+1]; out[2] = row[x*4]; out[3] = row[x*4+3];
+                }
+            }
+        }
+        *width = w;
+        *height = h;
+    }
+
+done:
+    inflateEnd(&strm);
+    free(filtered);
+    free(file);
+    return imageOut;
+}
+
+
+/*************************************/
+/*   ENCODE                          */
+/*************************************/
+
+// Filters one row with the filter of smallest absolute sum (the usual libpng heuristic)
+static void filterRow(unsigned char *out, const unsigned char *row, const unsigned char *prev, int rowBytes, int bpp,
+                      unsigned char *scratch) {
+    long bestSum = -1;
+    for (int filter = 0; filter < 5; filter++) {
+        unsigned char *dst = filter == 0 ? out + 1 : scratch;
+        long sum = 0;
+        for (int i = 0; i < rowBytes; i++) {
+            int left = i >= bpp ? row[i-bpp] : 0;
+            int up = prev ? prev[i] : 0;
+            int upLeft = prev && i >= bpp ? prev[i-bpp] : 0;
+            int predicted = filter == 0 ? 0 : filter == 1 ? left : filter == 2 ? up :
+                            filter == 3 ? (left + up) >> 1 : paeth(left, up, upLeft);
+            dst[i] = row[i] - predicted;
+            sum += (signed char) dst[i] < 0 ? -(signed char) dst[i] : dst[i];
+        }
+        if (bestSum < 0 || sum < bestSum) {
+            bestSum = sum;
+            out[0] = filter;
+            if (filter) {
+                memcpy(out + 1, scratch, rowBytes);
+            }
+        }
+    }
+}
+
+static void writeChunk(FILE *f, const char *type, const unsigned char *data, uint32_t length) {
+    unsigned char header[8];
+    writeU32(header, length);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(crc32(0, header + 4, 4), data, length);
+    unsigned char footer[4];
+    writeU32(footer, crc);
+    fwrite(header, 1, 8, f);
+    fwrite(data, 1, length, f);
+    fwrite(footer, 1, 4, f);
+}
+
+
+/*
+    Saves height top-down rows of width pixels, 3 bytes (R, G, B) each, or
+    1 byte palette indexes when palette is given. The filtered rows are cut
+    into chunks that are deflated on threads threads (the way pigz does it):
+    every chunk is a raw deflate stream primed with the last 32 KB of the
+    previous one and ended with a sync flush, so the pieces concatenate into
+    one zlib stream whose Adler-32 is combined from the per chunk sums.
+*/
+
+int pngSave(const char *fileName, const unsigned char *pixels, int width, int height, int channels,
+            const struct Color *palette, int paletteSize, int threads) {
+
+    long rowBytes = (long) width * channels;
+    long stride = rowBytes + 1;
+    unsigned char *filtered = malloc(stride * height);
+
+    // Palette images compress best unfiltered, color images pick a filter per row
+    #pragma omp parallel num_threads(threads)
+    {
+        unsigned char *scratch = malloc(rowBytes);
+        #pragma omp for schedule(static)
+        for (int y = 0; y < height; y++) {
+            const unsigned char *row = pixels + rowBytes * y;
+            if (palette) {
+                filtered[stride * y] = 0;
+                memcpy(filtered + stride * y + 1, row, rowBytes);
+            }
+            else {
+                filterRow(filtered + stride * y, row, y ? row - rowBytes : NULL, rowBytes, channels, scratch);
+            }
+        }
+        free(scratch);
+    }
+
+    long total = stride * height;
+    int numChunks = (int) ((total + CHUNK_BYTES - 1) / CHUNK_BYTES);
+    unsigned char **out = malloc(numChunks * sizeof(unsigned char *));
+    long *outSize = malloc(numChunks * sizeof(long));
+    long *inSize = malloc(numChunks * sizeof(long));
+    uLong *adler = malloc(numChunks * sizeof(uLong));
+    int failed = 0;
+
+    #pragma omp parallel for schedule(dynamic) num_threads(threads) reduction(|:failed)
+    for (int i = 0; i < numChunks; i++) {
+        long start = (long) i * CHUNK_BYTES;
+        long length = start + CHUNK_BYTES < total ? CHUNK_BYTES : total - start;
+        int last = i == numChunks - 1;
+        inSize[i] = length;
+
+        z_stream strm = { 0 };
+        deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        if (i > 0) {
+            long dict = start < DICT_BYTES ? start : DICT_BYTES;
+            deflateSetDictionary(&strm, filtered + start - dict, dict);
+        }
+        long bound = deflateBound(&strm, length) + 16;
+        out[i] = malloc(bound);
+        strm.next_in = filtered + start;
+        strm.avail_in = length;
+        strm.next_out = out[i];
+        strm.avail_out = bound;
+        int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+        failed |= strm.avail_in != 0 || ret != (last ? Z_STREAM_END : Z_OK);
+        outSize[i] = bound - strm.avail_out;
+        deflateEnd(&strm);
+        adler[i] = adler32(1, filtered + start, length);
+    }
+
+    FILE *f = failed ? NULL : fopen(fileName, "wb");
+    if (f) {
+        fwrite(signature, 1, 8, f);
+
+        unsigned char ihdr[13];
+        writeU32(ihdr, width);
+        writeU32(ihdr + 4, height);
+        ihdr[8] = 8;
+        ihdr[9] = palette ? 3 : 2;
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+        writeChunk(f, "IHDR", ihdr, 13);
+
+        if (palette) {
+            unsigned char plte[256 * 3];
+            for (int j = 0; j < paletteSize; j++) {
+                plte[j*3] = palette[j].R;
+                plte[j*3+1] = palette[j].G;
+                plte[j*3+2] = palette[j].B;
+            }
+            writeChunk(f, "PLTE", plte, paletteSize * 3);
+        }
+
+        // zlib header, the deflate pieces and the combined Adler-32, regrouped into IDAT chunks
+        uLong check = adler[0];
+        for (int i = 1; i < numChunks; i++) {
+            check = adler32_combine(check, adler[i], inSize[i]);
+        }
+        unsigned char *idat = malloc(IDAT_BYTES);
+        long used = 0;
+        idat[used++] = 0x78;
+        idat[used++] = 0x9C;
+        for (int i = 0; i < numChunks; i++) {
+            for (long done = 0; done < outSize[i]; ) {
+                long n = outSize[i] - done < IDAT_BYTES - used ? outSize[i] - done : IDAT_BYTES - used;
+                memcpy(idat + used, out[i] + done, n);
+                used += n;
+                done += n;
+                if (used == IDAT_BYTES) {
+                    writeChunk(f, "IDAT", idat, used);
+                    used = 0;
+                }
+            }
+        }
+        if (used + 4 > IDAT_BYTES) {
+            writeChunk(f, "IDAT", idat, used);
+            used = 0;
+        }
+        writeU32(idat + used, check);
+        writeChunk(f, "IDAT", idat, used + 4);
+        writeChunk(f, "IEND", idat, 0);
+        free(idat);
+        failed = fclose(f) != 0;
+    }
+    else {
+        failed = 1;
+    }
+
+    for (int i = 0; i < numChunks; i++) {
+        free(out[i]);
+    }
+    free(out);
+    free(outSize);
+    free(inSize);
+    free(adler);
+    free(filtered);
+    return !failed;
+}
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "kmeans.h"
+
+
+/*
+    Bounded queue that hands out items in sequence order. Producers may finish
+    out of order, an item is only put once its sequence number is within
+    capacity of the head, so at most capacity items are ever buffered.
+*/
+
+void queueInit(struct Queue *queue, int capacity, int end) {
+    queue->items = calloc(capacity, sizeof(void *));
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->end = end;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+}
+
+
+void queuePut(struct Queue *queue, int seq, void *item) {
+    pthread_mutex_lock(&queue->lock);
+    while (seq >= queue->head + queue->capacity) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    queue->items[seq % queue->capacity] = item;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+// Takes the next item in sequence, or NULL once all items were taken
+static void *take(struct Queue *queue, int wait) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (wait && queue->head < queue->end && !queue->items[queue->head % queue->capacity]) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    if (queue->head < queue->end && queue->items[queue->head % queue->capacity]) {
+        item = queue->items[queue->head % queue->capacity];
+        queue->items[queue->head % queue->capacity] = NULL;
+        queue->head++;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+
+void *queueGet(struct Queue *queue) {
+    return take(queue, 1);
+}
+
+
+void *queueTryGet(struct Queue *queue) {
+    return take(queue, 0);
+}
+
+
+void queueFree(struct Queue *queue) {
+    free(queue->items);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+}
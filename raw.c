@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+#include "kmeans.h"
+
+#define PAGE_SIZE 4096
+
+#define RAW_NONE 0
+#define RAW_PNM 1                       // PPM (P6) or PAM (P7), header gives the dimensions
+#define RAW_RGB 2
+#define RAW_RGBA 3
+#define RAW_BGRA 4                      // same layout as imageIn, mapped without a copy
+
+
+static int rawFormat(const char *fileName) {
+    const char *ext = strrchr(fileName, '.');
+    if (!ext) return RAW_NONE;
+    if (strcasecmp(ext, ".ppm") == 0 || strcasecmp(ext, ".pnm") == 0 || strcasecmp(ext, ".pam") == 0) return RAW_PNM;
+    if (strcasecmp(ext, ".rgb") == 0) return RAW_RGB;
+    if (strcasecmp(ext, ".rgba") == 0) return RAW_RGBA;
+    if (strcasecmp(ext, ".bgra") == 0) return RAW_BGRA;
+    return RAW_NONE;
+}
+
+int isRawFile(const char *fileName) {
+    return rawFormat(fileName) != RAW_NONE;
+}
+
+
+// Next whitespace separated token of a PNM header, skipping # comments
+static const char *pnmToken(const char *p, const char *end, char *token, int size) {
+    while (p < end && (isspace((unsigned char) *p) || *p == '#')) {
+        if (*p == '#') {
+            while (p < end && *p != '\n') p++;
+        }
+        else {
+            p++;
+        }
+    }
+    int n = 0;
+    while (p < end && !isspace((unsigned char) *p) && n < size - 1) {
+        token[n++] = *p++;
+    }
+    token[n] = '\0';
+    return p;
+}
+
+// Parses a P6 or P7 header, returns the offset of the pixel data or -1
+static long pnmHeader(const unsigned char *data, size_t size, int *width, int *height, int *channels) {
+    const char *p = (const char *) data;
+    const char *end = p + (size < 1024 ? size : 1024);
+    char token[32];
+    int maxval = 0;
+
+    p = pnmToken(p, end, token, sizeof(token));
+    if (strcmp(token, "P6") == 0) {
+        p = pnmToken(p, end, token, sizeof(token)); *width = atoi(token);
+        p = pnmToken(p, end, token, sizeof(token)); *height = atoi(token);
+        p = pnmToken(p, end, token, sizeof(token)); maxval = atoi(token);
+        *channels = 3;
+    }
+    else if (strcmp(token, "P7") == 0) {
+        *channels = 0;
+        while (1) {
+            p = pnmToken(p, end, token, sizeof(token));
+            if (token[0] == '\0') return -1;
+            if (strcmp(token, "ENDHDR") == 0) break;
+            char value[32];
+            if (strcmp(token, "TUPLTYPE") == 0) {
+                p = pnmToken(p, end, value, sizeof(value));
+                continue;
+            }
+            p = pnmToken(p, end, value, sizeof(value));
+            if (strcmp(token, "WIDTH") == 0) *width = atoi(value);
+            else if (strcmp(token, "HEIGHT") == 0) *height = atoi(value);
+            else if (strcmp(token, "DEPTH") == 0) *channels = atoi(value);
+            else if (strcmp(token, "MAXVAL") == 0) maxval = atoi(value);
+        }
+    }
+    else {
+        return -1;
+    }
+
+    // A single whitespace character separates the header from the pixels
+    if (p >= end || maxval != 255 || *width <= 0 || *height <= 0 ||
+        (*channels != 1 && *channels != 3 && *channels != 4)) {
+        return -1;
+    }
+    return p + 1 - (const char *) data;
+}
+
+
+/*
+    Loads a raw frame or a PPM/PAM file through mmap. PPM/PAM take their
+    dimensions from the header, raw .rgb/.rgba/.bgra frames from width and
+    height (the -g option). A headerless .bgra frame is already in the
+    (B, G, R, A) layout of the engines and is returned as the mapping itself,
+    *mapped is then set to its size for rawUnload. Other layouts are
+    converted straight from the mapping into a page aligned buffer, so they
+    can be wrapped by the device without a copy as well.
+*/
+
+unsigned char *rawLoad(const char *fileName, int *width, int *height, size_t *mapped) {
+    int format = rawFormat(fileName);
+    *mapped = 0;
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    // Private writable mapping, the engines may treat the points as their own
+    unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    int w = *width, h = *height, channels = 0;
+    long offset = 0;
+    if (format == RAW_PNM) {
+        offset = pnmHeader(data, size, &w, &h, &channels);
+    }
+    else {
+        channels = format == RAW_RGB ? 3 : 4;
+    }
+    if (offset < 0 || w <= 0 || h <= 0 || (long) w * h > MAX_PIXELS ||
+        offset + (size_t) w * h * channels > size) {
+        munmap(data, size);
+        return NULL;
+    }
+    *width = w;
+    *height = h;
+
+    if (format == RAW_BGRA) {
+        madvise(data, size, MADV_SEQUENTIAL);
+        *mapped = size;
+        return data;
+    }
+
+    unsigned char *imageIn;
+    if (posix_memalign((void **) &imageIn, PAGE_SIZE, (size_t) w * h * 4) != 0) {
+        munmap(data, size);
+        return NULL;
+    }
+    const unsigned char *pixels = data + offset;
+    long numPixels = (long) w * h;
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < numPixels; i++) {
+        const unsigned char *in = pixels + i * channels;
+        unsigned char *out = imageIn + i * 4;
+        if (channels == 1) {
+            out[0] = out[1] = out[2] = in[0];
+            out[3] = 255;
+        }
+        else {
+            out[0] = in[2];
+            out[1] = in[1];
+            out[2] = in[0];
+            out[3] = channels == 4 ? in[3] : 255;
+        }
+    }
+
+    munmap(data, size);
+    return imageIn;
+}
+
+void rawUnload(unsigned char *imageIn, size_t mapped) {
+    if (mapped) {
+        munmap(imageIn, mapped);
+    }
+    else {
+        free(imageIn);
+    }
+}
+
+
+/*
+    Creates the output file of an index map with size bytes and maps it
+    shared, so clustering writes the indexes straight into the file. size
+    may exceed the finished map (the CPU engine works on int indexes),
+    rawSaveIndexes trims it. Returns NULL on failure.
+*/
+
+void *rawMapIndexes(const char *fileName, size_t size) {
+    int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return NULL;
+    }
+    void *out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return out == MAP_FAILED ? NULL : out;
+}
+
+
+/*
+    Saves the cluster index map (numPixels indexes of indexSize bytes, row
+    by row) and the palette as K (R, G, B) triplets to fileName.pal. When c
+    is a mapping of fileName from rawMapIndexes (mapped is its size), it is
+    unmapped and the file truncated to the map, otherwise c is written
+    through a new mapping. Returns 0 on failure.
+*/
+
+int rawSaveIndexes(const char *fileName, void *c, size_t mapped, long numPixels, int indexSize,
+                   const struct Color *centroids, int K) {
+    size_t size = numPixels * indexSize;
+
+    if (mapped) {
+        if (munmap(c, mapped) != 0 || truncate(fileName, size) != 0) {
+            return 0;
+        }
+    }
+    else {
+        unsigned char *out = rawMapIndexes(fileName, size);
+        if (!out) {
+            return 0;
+        }
+        memcpy(out, c, size);
+        munmap(out, size);
+    }
+
+    char palFile[4096];
+    snprintf(palFile, sizeof(palFile), "%s.pal", fileName);
+    FILE *f = fopen(palFile, "wb");
+    if (!f) {
+        return 0;
+    }
+    for (int j = 0; j < K; j++) {
+        unsigned char rgb[3] = { centroids[j].R, centroids[j].G, centroids[j].B };
+        fwrite(rgb, 1, 3, f);
+    }
+    return fclose(f) == 0;
+}
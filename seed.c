@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <omp.h>
+#include "kmeans.h"
+
+#define SEED_SAMPLE 65536               // points the seeding looks at, larger inputs are subsampled
+#define SEED_ROUNDS 5                   // k-means|| oversampling rounds
+#define SEED_OVERSAMPLE 2               // expected candidates per round, times K
+#define SEED_LLOYD 5                    // weighted Lloyd iterations on the candidates
+
+
+// Counter based hash, every (round, point) draws its own number independent of the thread that handles it
+static inline uint32_t mix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static inline double uniform(uint32_t seed, uint32_t round, uint32_t i) {
+    return mix(seed ^ mix(round * 0x9e3779b9 ^ mix(i))) / 4294967296.0;
+}
+
+static inline int distance(const unsigned char *a, const unsigned char *b) {
+    int dB = a[0] - b[0];
+    int dG = a[1] - b[1];
+    int dR = a[2] - b[2];
+    return dB * dB + dG * dG + dR * dR;
+}
+
+static int nearest(const unsigned char *point, const unsigned char *centers, int numCenters, int *dist) {
+    int best = 0;
+    int bestDist = INT32_MAX;
+    for (int j = 0; j < numCenters; j++) {
+        int d = distance(point, &centers[j*4]);
+        if (d < bestDist) {
+            bestDist = d;
+            best = j;
+        }
+    }
+    *dist = bestDist;
+    return best;
+}
+
+// Picks an index with probability proportional to p, total is the sum of p
+static int pick(const double *p, int n, double total, double r) {
+    double target = r * total;
+    for (int i = 0; i < n; i++) {
+        target -= p[i];
+        if (target < 0) {
+            return i;
+        }
+    }
+    return n - 1;
+}
+
+
+/*
+    k-means|| seeding (Bahmani et al., Scalable K-Means++). Starting from one
+    random point, every round keeps each point as a candidate with
+    probability proportional to its squared distance to the candidates so
+    far, about SEED_OVERSAMPLE * K per round, and updates the distances in
+    parallel. The candidates are weighted by the points closest to them and
+    reduced to K centroids with weighted k-means++ and a few Lloyd
+    iterations. Works on (B, G, R, A) points, weights may be NULL.
+*/
+
+void seedCentroids(const unsigned char *points, const int *weights, long numPoints, struct Color *centroids, int K,
+                   unsigned int seed) {
+
+    // Sample of the points, all of them for small inputs
+    int n = numPoints < SEED_SAMPLE ? numPoints : SEED_SAMPLE;
+    unsigned char *x = malloc(n * 4);
+    double *w = malloc(n * sizeof(double));
+    double *d = malloc(n * sizeof(double));
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        long src = n == numPoints ? i : (long) (mix(seed ^ mix(i + 1)) % numPoints);
+        memcpy(&x[i*4], &points[src*4], 4);
+        w[i] = weights ? weights[src] : 1;
+    }
+
+    int capacity = 1 + SEED_ROUNDS * SEED_OVERSAMPLE * K * 2;
+    unsigned char *candidates = malloc(capacity * 4);
+    int numCandidates = 1;
+    memcpy(candidates, &x[(mix(seed) % n) * 4], 4);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        d[i] = distance(&x[i*4], candidates);
+    }
+
+
+    /*************************************/
+    /*   OVERSAMPLING ROUNDS             */
+    /*************************************/
+
+    double l = SEED_OVERSAMPLE * K;
+    for (int round = 1; round <= SEED_ROUNDS; round++) {
+        double phi = 0;
+        #pragma omp parallel for schedule(static) reduction(+:phi)
+        for (int i = 0; i < n; i++) {
+            phi += w[i] * d[i];
+        }
+        if (phi == 0) {
+            break;
+        }
+
+        int first = numCandidates;
+        for (int i = 0; i < n; i++) {
+            if (uniform(seed, round, i) * phi < l * w[i] * d[i]) {
+                if (numCandidates == capacity) {
+                    capacity *= 2;
+                    candidates = realloc(candidates, capacity * 4);
+                }
+                memcpy(&candidates[numCandidates*4], &x[i*4], 4);
+                numCandidates++;
+            }
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            for (int j = first; j < numCandidates; j++) {
+                int dist = distance(&x[i*4], &candidates[j*4]);
+                if (dist < d[i]) {
+                    d[i] = dist;
+                }
+            }
+        }
+    }
+
+
+    /*************************************/
+    /*   REDUCE CANDIDATES TO K          */
+    /*************************************/
+
+    // Weight of a candidate: the (weighted) number of points closest to it
+    double *cw = calloc(numCandidates, sizeof(double));
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        int dist;
+        int j = nearest(&x[i*4], candidates, numCandidates, &dist);
+        #pragma omp atomic update
+        cw[j] += w[i];
+    }
+
+    // Weighted k-means++ over the candidates
+    unsigned char *centers = malloc(K * 4);
+    double *cd = malloc(numCandidates * sizeof(double));
+    double *p = malloc(numCandidates * sizeof(double));
+    double total = 0;
+    for (int j = 0; j < numCandidates; j++) {
+        cd[j] = DBL_MAX;
+        total += cw[j];
+    }
+    int chosen = pick(cw, numCandidates, total, uniform(seed, 0, 0));
+    memcpy(centers, &candidates[chosen*4], 4);
+
+    for (int k = 1; k < K; k++) {
+        total = 0;
+        for (int j = 0; j < numCandidates; j++) {
+            int dist = distance(&candidates[j*4], &centers[(k-1)*4]);
+            if (dist < cd[j]) {
+                cd[j] = dist;
+            }
+            p[j] = cw[j] * cd[j];
+            total += p[j];
+        }
+        if (total > 0) {
+            chosen = pick(p, numCandidates, total, uniform(seed, 0, k));
+            memcpy(&centers[k*4], &candidates[chosen*4], 4);
+        }
+        else {
+            // Fewer distinct colors than clusters, the engines refill the empty clusters
+            memcpy(&centers[k*4], &x[(mix(seed ^ k) % n) * 4], 4);
+        }
+    }
+
+    // Lloyd iterations on the weighted candidates
+    double *sums = malloc(K * 4 * sizeof(double));
+    for (int it = 0; it < SEED_LLOYD; it++) {
+        memset(sums, 0, K * 4 * sizeof(double));
+        for (int j = 0; j < numCandidates; j++) {
+            int dist;
+            int k = nearest(&candidates[j*4], centers, K, &dist);
+            sums[k*4] += cw[j] * candidates[j*4];
+            sums[k*4+1] += cw[j] * candidates[j*4+1];
+            sums[k*4+2] += cw[j] * candidates[j*4+2];
+            sums[k*4+3] += cw[j];
+        }
+        for (int k = 0; k < K; k++) {
+            if (sums[k*4+3] > 0) {
+                centers[k*4] = (unsigned char) (sums[k*4] / sums[k*4+3] + 0.5);
+                centers[k*4+1] = (unsigned char) (sums[k*4+1] / sums[k*4+3] + 0.5);
+                centers[k*4+2] = (unsigned char) (sums[k*4+2] / sums[k*4+3] + 0.5);
+            }
+        }
+    }
+
+    for (int k = 0; k < K; k++) {
+        centroids[k].B = centers[k*4];
+        centroids[k].G = centers[k*4+1];
+        centroids[k].R = centers[k*4+2];
+    }
+
+    free(sums);
+    free(p);
+    free(cd);
+    free(centers);
+    free(cw);
+    free(candidates);
+    free(d);
+    free(w);
+    free(x);
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Reduction benchmark: clusters random .bgra frames of several sizes with
+# several K, once with -r atomic and once with -r tree, and prints the best
+# clustering time (the Time line) of RUNS runs of each, plus tree/atomic.
+# Noise frames spread the pixels over all clusters, so contention on the
+# sums grows with the number of work-groups (pixels) and shrinks with K.
+#
+# Usage: tests/bench_reduce.sh [path/to/gpu]
+#        SIZES="1024x768 2048x2048 4096x4096" KS="16 64 256 1024" RUNS=3
+
+GPU=${1:-./gpu}
+SIZES=${SIZES:-"1024x768 2048x2048 4096x4096"}
+KS=${KS:-"16 64 256 1024"}
+RUNS=${RUNS:-3}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Best Time of RUNS runs, or "-" if a run fails
+best() {
+    t="-"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        run=$("$GPU" "$DIR/in.bgra" "$DIR/out.idx" -g "$size" -x -K "$K" -I 10 -S 1 -r "$1" 2> "$DIR/log" \
+              | awk '/^Time:/ { sub("s", "", $2); print $2 }')
+        if [ -z "$run" ]; then
+            cat "$DIR/log" >&2
+            echo "-"
+            return
+        fi
+        t=$(echo "$t $run" | awk '{ print ($1 == "-" || $2 < $1) ? $2 : $1 }')
+        i=$((i + 1))
+    done
+    echo "$t"
+}
+
+printf '%-10s %5s %9s %9s %6s\n' size K atomic tree ratio
+for size in $SIZES; do
+    w=${size%x*}
+    h=${size#*x}
+    head -c $((w * h * 4)) /dev/urandom > "$DIR/in.bgra"
+    for K in $KS; do
+        atomic=$(best atomic)
+        tree=$(best tree)
+        ratio=$(echo "$atomic $tree" | awk '{ print ($1 == "-" || $2 == "-" || $1 == 0) ? "-" : sprintf("%.2f", $2 / $1) }')
+        printf '%-10s %5s %9s %9s %6s\n' "$size" "$K" "$atomic" "$tree" "$ratio"
+    done
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Solid color check: a 3000x3000 white frame (9M pixels, one point of weight
+# 9M with -u) must give only (255, 255, 255) centroids on every backend, with
+# and without -u. Cluster sums of such an image overflow 32 bits.
+#
+# Usage: tests/solid_color.sh [path/to/gpu]   (BACKENDS="cpu" to skip the GPU)
+
+GPU=${1:-./gpu}
+BACKENDS=${BACKENDS:-"gpu cpu"}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+{ printf 'P6\n3000 3000\n255\n'; head -c 27000000 /dev/zero | tr '\0' '\377'; } > "$DIR/white.ppm"
+
+failed=0
+for backend in $BACKENDS; do
+    for compact in "" "-u"; do
+        name="-b $backend $compact"
+        "$GPU" "$DIR/white.ppm" "$DIR/out.idx" -x -K 4 -I 5 -S 1 -b $backend $compact > "$DIR/log" 2>&1
+        status=$?
+        if [ $status -ne 0 ]; then
+            echo "FAIL $name: exit status $status"
+            cat "$DIR/log"
+            failed=1
+            continue
+        fi
+        # The palette is K (R, G, B) byte triplets, all of them must be 255
+        other=$(od -An -v -tu1 "$DIR/out.idx.pal" | tr -s ' ' '\n' | grep -v -e '^$' -e '^255$' | head -1)
+        if [ -n "$other" ] || [ ! -s "$DIR/out.idx.pal" ]; then
+            echo "FAIL $name: palette $(od -An -v -tu1 "$DIR/out.idx.pal")"
+            failed=1
+        else
+            echo "ok   $name"
+        fi
+    done
+done
+exit $failed